@@ -0,0 +1,395 @@
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BERNOULLI_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "bernoulli.h"
+
+
+// Spreads the bits of a mask out into bytes, least significant first (in memory, on a
+// little-endian machine).
+static constexpr std::array<uint64_t, 256> mask_bytes {
+  []() {
+    std::array<uint64_t, 256> bytes {};
+    for (unsigned int mask {0}; mask < 256; ++mask) {
+      for (unsigned int bit {0}; bit < 8; ++bit) {
+        bytes[mask] |= static_cast<uint64_t>((mask >> bit) & 1) << (8 * bit);
+      }
+    }
+    return bytes;
+  }()};
+
+using State = BernoulliStream::State;
+static constexpr std::size_t num_lanes {BernoulliStream::num_lanes};
+
+// Each bitplane kernel writes num_batches * num_lanes words: word i comes from lane i % num_lanes.
+// The barrier must not be 0.
+using BitplaneKernel = void (*)(State &state, uint64_t barrier, uint64_t* out,
+                                std::size_t num_batches);
+
+static inline uint64_t rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+// All ones if the given binary digit of p is 1, or else all zeros.
+static inline uint64_t digit_mask(uint64_t barrier, int digit) {
+  return 0 - ((barrier >> digit) & 1);
+}
+
+static inline uint64_t xoshiro_next(State &state, std::size_t lane) {
+  auto &s {state.words};
+  const uint64_t result {rotl(s[0][lane] + s[3][lane], 23) + s[0][lane]};
+  const uint64_t t {s[1][lane] << 17};
+  s[2][lane] ^= s[0][lane];
+  s[3][lane] ^= s[1][lane];
+  s[1][lane] ^= s[2][lane];
+  s[0][lane] ^= s[3][lane];
+  s[2][lane] ^= t;
+  s[3][lane] = rotl(s[3][lane], 45);
+  return result;
+}
+
+// Every lane draws a random word for each digit, until all the lanes' bitplanes are settled.
+static void scalar_bitplanes(State &state, uint64_t barrier, uint64_t* out,
+                             std::size_t num_batches) {
+  const int lowest_digit {std::countr_zero(barrier)};
+  for (std::size_t batch {0}; batch < num_batches; ++batch) {
+    uint64_t* bits {out + batch * num_lanes};
+    uint64_t undecided[num_lanes];
+    std::fill(bits, bits + num_lanes, 0);
+    std::fill(undecided, undecided + num_lanes, ~uint64_t{0});
+    for (int digit {63}; digit >= lowest_digit; --digit) {
+      // Branching on p's digit would be mispredicted half the time.
+      const uint64_t p_digit {digit_mask(barrier, digit)};
+      uint64_t any_undecided {0};
+      for (std::size_t lane {0}; lane < num_lanes; ++lane) {
+        const uint64_t u {xoshiro_next(state, lane)};
+        bits[lane] |= undecided[lane] & ~u & p_digit;  // Settled: u's digit is less than p's.
+        undecided[lane] &= ~(u ^ p_digit);  // Still undecided where the digits are equal.
+        any_undecided |= undecided[lane];
+      }
+      if (any_undecided == 0) {
+        break;
+      }
+    }
+  }
+}
+
+#ifdef BERNOULLI_X86_KERNELS
+__attribute__((target("avx2")))
+static inline __m256i rotl_avx2(__m256i x, int k) {
+  return _mm256_or_si256(_mm256_slli_epi64(x, k), _mm256_srli_epi64(x, 64 - k));
+}
+
+// Advances four lanes, whose state is in v.
+__attribute__((target("avx2")))
+static inline __m256i xoshiro_next_avx2(__m256i (&v)[4]) {
+  const __m256i result {_mm256_add_epi64(rotl_avx2(_mm256_add_epi64(v[0], v[3]), 23), v[0])};
+  const __m256i t {_mm256_slli_epi64(v[1], 17)};
+  v[2] = _mm256_xor_si256(v[2], v[0]);
+  v[3] = _mm256_xor_si256(v[3], v[1]);
+  v[1] = _mm256_xor_si256(v[1], v[2]);
+  v[0] = _mm256_xor_si256(v[0], v[3]);
+  v[2] = _mm256_xor_si256(v[2], t);
+  v[3] = rotl_avx2(v[3], 45);
+  return result;
+}
+
+// Two vectors of four lanes each.
+__attribute__((target("avx2")))
+static void load_avx2(const State &state, __m256i (&v)[2][4]) {
+  for (int half {0}; half < 2; ++half) {
+    for (int k {0}; k < 4; ++k) {
+      v[half][k] = _mm256_load_si256(
+        reinterpret_cast<const __m256i*>(&state.words[k][4 * half]));
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void store_avx2(State &state, const __m256i (&v)[2][4]) {
+  for (int half {0}; half < 2; ++half) {
+    for (int k {0}; k < 4; ++k) {
+      _mm256_store_si256(reinterpret_cast<__m256i*>(&state.words[k][4 * half]), v[half][k]);
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void avx2_bitplanes(State &state, uint64_t barrier, uint64_t* out,
+                           std::size_t num_batches) {
+  const int lowest_digit {std::countr_zero(barrier)};
+  __m256i v[2][4];
+  load_avx2(state, v);
+  for (std::size_t batch {0}; batch < num_batches; ++batch) {
+    __m256i bits[2] {_mm256_setzero_si256(), _mm256_setzero_si256()};
+    __m256i undecided[2] {_mm256_set1_epi64x(-1), _mm256_set1_epi64x(-1)};
+    for (int digit {63}; digit >= lowest_digit; --digit) {
+      const __m256i p_digit {
+        _mm256_set1_epi64x(static_cast<long long>(digit_mask(barrier, digit)))};
+      for (int half {0}; half < 2; ++half) {
+        const __m256i u {xoshiro_next_avx2(v[half])};
+        bits[half] = _mm256_or_si256(
+          bits[half], _mm256_and_si256(_mm256_andnot_si256(u, undecided[half]), p_digit));
+        undecided[half] = _mm256_andnot_si256(_mm256_xor_si256(u, p_digit), undecided[half]);
+      }
+      const __m256i any_undecided {_mm256_or_si256(undecided[0], undecided[1])};
+      if (_mm256_testz_si256(any_undecided, any_undecided)) {
+        break;
+      }
+    }
+    for (int half {0}; half < 2; ++half) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + batch * num_lanes + 4 * half),
+                          bits[half]);
+    }
+  }
+  store_avx2(state, v);
+}
+
+// One vector of eight lanes.
+// GCC 12's own AVX-512 headers trip -Wmaybe-uninitialized (GCC bug 105593).
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+static inline __m512i xoshiro_next_avx512(__m512i (&v)[4]) {
+  const __m512i result {_mm512_add_epi64(_mm512_rol_epi64(_mm512_add_epi64(v[0], v[3]), 23),
+                                         v[0])};
+  const __m512i t {_mm512_slli_epi64(v[1], 17)};
+  v[2] = _mm512_xor_si512(v[2], v[0]);
+  v[3] = _mm512_xor_si512(v[3], v[1]);
+  v[1] = _mm512_xor_si512(v[1], v[2]);
+  v[0] = _mm512_xor_si512(v[0], v[3]);
+  v[2] = _mm512_xor_si512(v[2], t);
+  v[3] = _mm512_rol_epi64(v[3], 45);
+  return result;
+}
+
+__attribute__((target("avx512f")))
+static void avx512_bitplanes(State &state, uint64_t barrier, uint64_t* out,
+                             std::size_t num_batches) {
+  const int lowest_digit {std::countr_zero(barrier)};
+  __m512i v[4];
+  for (int k {0}; k < 4; ++k) {
+    v[k] = _mm512_load_si512(&state.words[k][0]);
+  }
+  for (std::size_t batch {0}; batch < num_batches; ++batch) {
+    __m512i bits {_mm512_setzero_si512()};
+    __m512i undecided {_mm512_set1_epi64(-1)};
+    for (int digit {63}; digit >= lowest_digit; --digit) {
+      const __m512i p_digit {
+        _mm512_set1_epi64(static_cast<long long>(digit_mask(barrier, digit)))};
+      const __m512i u {xoshiro_next_avx512(v)};
+      bits = _mm512_or_si512(bits, _mm512_and_si512(_mm512_andnot_si512(u, undecided), p_digit));
+      undecided = _mm512_andnot_si512(_mm512_xor_si512(u, p_digit), undecided);
+      if (_mm512_test_epi64_mask(undecided, undecided) == 0) {
+        break;
+      }
+    }
+    _mm512_storeu_si512(out + batch * num_lanes, bits);
+  }
+  for (int k {0}; k < 4; ++k) {
+    _mm512_store_si512(&state.words[k][0], v[k]);
+  }
+}
+#pragma GCC diagnostic pop
+#endif
+
+// For the engines other than xoshiro256++, which have no vector kernels. The lanes are in step,
+// as in the other kernels, but they all draw from the one stream, a batch of words per digit.
+static void engine_bitplanes(RandomStream &rng, uint64_t barrier, uint64_t* out,
+                             std::size_t num_batches) {
+  const int lowest_digit {std::countr_zero(barrier)};
+  for (std::size_t batch {0}; batch < num_batches; ++batch) {
+    uint64_t* bits {out + batch * num_lanes};
+    uint64_t undecided[num_lanes];
+    std::fill(bits, bits + num_lanes, 0);
+    std::fill(undecided, undecided + num_lanes, ~uint64_t{0});
+    for (int digit {63}; digit >= lowest_digit; --digit) {
+      const uint64_t p_digit {digit_mask(barrier, digit)};
+      uint64_t u[num_lanes];
+      rng.generate(u, num_lanes);
+      uint64_t any_undecided {0};
+      for (std::size_t lane {0}; lane < num_lanes; ++lane) {
+        bits[lane] |= undecided[lane] & ~u[lane] & p_digit;
+        undecided[lane] &= ~(u[lane] ^ p_digit);
+        any_undecided |= undecided[lane];
+      }
+      if (any_undecided == 0) {
+        break;
+      }
+    }
+  }
+}
+
+static BitplaneKernel bitplane_kernel_for(SimdLevel level) {
+  switch (level) {
+#ifdef BERNOULLI_X86_KERNELS
+  case SimdLevel::avx512:
+    return avx512_bitplanes;
+  case SimdLevel::avx2:
+    return avx2_bitplanes;
+#endif
+  default:
+    return scalar_bitplanes;
+  }
+}
+
+// Asks the CPU (by CPUID) which instructions it has. Levels the CPU supports but the compiler
+// can't target are reported as scalar. The vector kernels rely on GCC and Clang's per-function
+// target attributes, so MSVC builds always use the scalar kernel: there'd be nothing to detect.
+SimdLevel BernoulliStream::best_simd_level() {
+#ifdef BERNOULLI_X86_KERNELS
+  static const SimdLevel best {
+    []() {
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx512f")) {
+        return SimdLevel::avx512;
+      }
+      if (__builtin_cpu_supports("avx2")) {
+        return SimdLevel::avx2;
+      }
+      return SimdLevel::scalar;
+    }()};
+  return best;
+#else
+  return SimdLevel::scalar;
+#endif
+}
+
+const char* BernoulliStream::simd_level_name(SimdLevel level) {
+  switch (level) {
+  case SimdLevel::avx512:
+    return "AVX-512";
+  case SimdLevel::avx2:
+    return "AVX2";
+  default:
+    return "scalar";
+  }
+}
+
+// The lanes are seeded from (seed, stream) as a RandomStream would be, and then apart from each
+// other by splitmix64. With any other engine than xoshiro256++, the lanes are unused, and the bits
+// come from a RandomStream of that engine instead.
+BernoulliStream::BernoulliStream(double p, uint64_t seed, uint64_t stream,
+                                 unsigned int precision, RandomEngine random_engine,
+                                 SimdLevel simd_level)
+  : barrier {p <= 0.0 || p >= 1.0 ? 0 : static_cast<uint64_t>(std::ldexp(p, 64))}
+  , always {p >= 1.0}
+  , level {std::min(simd_level, best_simd_level())}
+  , engine {random_engine}
+  , rng {seed, stream, random_engine}
+{
+  precision = std::clamp(precision, 1U, max_precision);
+  if (precision < 64) {
+    barrier &= ~uint64_t{0} << (64 - precision);
+  }
+  uint64_t x {RandomStream::splitmix64(seed + RandomStream::splitmix64(stream))};
+  for (auto &words : state.words) {
+    for (auto &word : words) {
+      x = RandomStream::splitmix64(x);
+      word = x == 0 ? 1 : x;
+    }
+  }
+}
+
+// Writes n bytes, each 1 with probability p, or else 0, unpacked from bitplanes. The lanes are
+// advanced by whole batches, so a call for n bytes uses up the same randomness as a call for n
+// rounded up to a multiple of 64 * num_lanes.
+void BernoulliStream::generate(uint8_t* out, std::size_t n) {
+  constexpr std::size_t words_per_chunk {8 * num_lanes};
+  uint64_t words[words_per_chunk];
+  for (std::size_t begin {0}; begin < n; begin += 64 * words_per_chunk) {
+    const std::size_t chunk_size {std::min(n - begin, 64 * words_per_chunk)};
+    const std::size_t num_words {(chunk_size + 63) / 64};
+    generate_bitplanes(words, num_words);
+    for (std::size_t i {0}; i < chunk_size; i += 8) {
+      const uint64_t bytes {mask_bytes[(words[i / 64] >> (i % 64)) & 0xFF]};
+      std::memcpy(out + begin + i, &bytes, std::min<std::size_t>(8, chunk_size - i));
+    }
+  }
+}
+
+// Writes n words of 64 bits, each bit 1 with probability p, or else 0. The lanes are advanced by
+// whole batches, so n is in effect rounded up to a multiple of num_lanes.
+void BernoulliStream::generate_bitplanes(uint64_t* out, std::size_t n) {
+  if (always || barrier == 0) {
+    std::fill(out, out + n, always ? ~uint64_t{0} : 0);
+    return;
+  }
+  const BitplaneKernel kernel {bitplane_kernel_for(level)};
+  auto run_kernel {
+    [&](uint64_t* batches, std::size_t num_batches) {
+      if (engine == RandomEngine::xoshiro) {
+        kernel(state, barrier, batches, num_batches);
+      } else {
+        engine_bitplanes(rng, barrier, batches, num_batches);
+      }
+    }};
+  const std::size_t whole_batches {n / num_lanes};
+  run_kernel(out, whole_batches);
+  const std::size_t remainder {n % num_lanes};
+  if (remainder > 0) {
+    uint64_t last_batch[num_lanes];
+    run_kernel(last_batch, 1);
+    std::copy(last_batch, last_batch + remainder, out + whole_batches * num_lanes);
+  }
+}
+
+// p, truncated to the given number of binary digits.
+static double truncate_probability(double p, unsigned int precision) {
+  precision = std::clamp(precision, 1U, BernoulliStream::max_precision);
+  if (p >= 1.0) {
+    return 1.0;
+  }
+  return std::ldexp(std::floor(std::ldexp(std::max(p, 0.0), precision)), -precision);
+}
+
+BernoulliSkipper::BernoulliSkipper(double p, uint64_t seed, uint64_t stream,
+                                   unsigned int precision, RandomEngine engine)
+  : rng {seed, stream, engine}
+{
+  p = truncate_probability(p, precision);
+  majority_state = p > 0.5;
+  const double minority_probability {majority_state ? 1.0 - p : p};
+  log_majority_probability = std::log1p(-minority_probability);
+}
+
+// Whether skipping is faster than drawing bits for every site (see BernoulliStream): when only
+// about one site in 64 or fewer is in the minority. (They break even at about one in 50.)
+bool BernoulliSkipper::worthwhile(double p, unsigned int precision) {
+  constexpr double max_minority_probability {1.0 / 64};
+  p = truncate_probability(p, precision);
+  return std::min(p, 1.0 - p) <= max_minority_probability;
+}
+
+// The state of every site but the ones that first() and next() pick out.
+bool BernoulliSkipper::majority() const {
+  return majority_state;
+}
+
+std::size_t BernoulliSkipper::first() {
+  return skip();
+}
+
+std::size_t BernoulliSkipper::next(std::size_t previous) {
+  return previous + 1 + skip();
+}
+
+// The number of majority sites before the next minority site.
+std::size_t BernoulliSkipper::skip() {
+  constexpr std::size_t never {std::numeric_limits<std::size_t>::max() / 2};
+  if (log_majority_probability == 0.0) {
+    return never;  // There is no minority.
+  }
+  // Uniform in (0, 1].
+  const double u {std::ldexp(static_cast<double>((rng.next() >> 11) + 1), -53)};
+  const double sites {std::floor(std::log(u) / log_majority_probability)};
+  return sites < static_cast<double>(never) ? static_cast<std::size_t>(sites) : never;
+}
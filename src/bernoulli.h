@@ -0,0 +1,82 @@
+#ifndef BERNOULLI_H
+#define BERNOULLI_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "random.h"
+
+
+// The widest vector instructions that BernoulliStream can use.
+enum class SimdLevel : int {scalar, avx2, avx512};
+
+// Makes Bernoulli(p) bits from eight xoshiro256++ generators run side by side, so that a whole
+// batch of them fits in one or two vector registers. p is truncated to the given number of binary
+// digits (at most 64), and p = 1 gives only ones.
+//
+// The bits are made 64 to a word (a "bitplane"), and may then be unpacked one to a byte. A
+// bitplane compares 64 random numbers against p at once, one binary digit at a time from the most
+// significant, with bit i of each random word being the next digit of the i-th number. Each
+// comparison is settled at the first digit where the number and p differ, so a bitplane usually
+// takes only about log2(64) + 2 = 8 random words, rather than 64.
+//
+// The instructions are chosen at run time, from what the CPU supports. The output is the same
+// whatever they are. Other engines than xoshiro256++ can be asked for, but these have no vector
+// instructions, and are several times slower.
+class BernoulliStream {
+public:
+  static constexpr std::size_t num_lanes {8};
+  static constexpr unsigned int max_precision {64};
+
+  BernoulliStream(double p, uint64_t seed, uint64_t stream,
+                  unsigned int precision = max_precision,
+                  RandomEngine engine = default_random_engine,
+                  SimdLevel level = best_simd_level());
+
+  void generate(uint8_t* out, std::size_t n);
+  void generate_bitplanes(uint64_t* out, std::size_t n);
+
+  static SimdLevel best_simd_level();
+  static const char* simd_level_name(SimdLevel level);
+
+  // The state of all lanes: words[k][lane] is word k of that lane's generator.
+  struct alignas(64) State {
+    uint64_t words[4][num_lanes];
+  };
+
+private:
+  State state;
+  uint64_t barrier;  // p, as a 64-bit fraction
+  bool always;  // p >= 1
+  SimdLevel level;
+  RandomEngine engine;
+  RandomStream rng;  // Only for engines other than xoshiro256++
+};
+
+// For p close to 0 or 1, where it's cheaper to pick out only the few sites that differ from the
+// rest (the "minority") than to draw bits for them all. It jumps from one minority site to the
+// next by geometrically distributed skips, so its cost is proportional to the number of minority
+// sites, not to the number of sites.
+//
+//   for (std::size_t i {skipper.first()}; i < n; i = skipper.next(i)) { ... }
+class BernoulliSkipper {
+public:
+  BernoulliSkipper(double p, uint64_t seed, uint64_t stream,
+                   unsigned int precision = BernoulliStream::max_precision,
+                   RandomEngine engine = default_random_engine);
+
+  static bool worthwhile(double p, unsigned int precision = BernoulliStream::max_precision);
+  bool majority() const;
+  std::size_t first();
+  std::size_t next(std::size_t previous);
+
+private:
+  std::size_t skip();
+
+  RandomStream rng;
+  bool majority_state;
+  double log_majority_probability;  // log(1 - q), where q is the chance of a minority site
+};
+
+
+#endif  // BERNOULLI_H
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <cassert>
+
+#include "bitslicedlattice.h"
+#include "bernoulli.h"
+
+
+BitslicedLattice::BitslicedLattice(unsigned int width, unsigned int height) {
+  set_size(width, height);
+}
+
+// Leaves the contents undefined; you must call fill() after this.
+void BitslicedLattice::set_size(unsigned int width, unsigned int height) {
+  assert(width > 0 && height > 0);
+  grid_width = width;
+  grid_height = height;
+  open.resize(static_cast<std::size_t>(width) * height);
+  reached.resize(open.size());
+}
+
+unsigned int BitslicedLattice::get_width() const {
+  return grid_width;
+}
+
+unsigned int BitslicedLattice::get_height() const {
+  return grid_height;
+}
+
+// Lane i gets exactly the lattice that Lattice::fill(f, first_seed + i, progress, engine) would
+// make. This is slow (it works through the lanes one at a time); use fill_bernoulli() where
+// possible.
+void BitslicedLattice::fill(measure::filler f, uint64_t first_seed, RandomEngine engine) {
+  std::fill(open.begin(), open.end(), 0);
+  constexpr unsigned int rows_per_block {Lattice::fill_block_rows};
+  std::vector<uint8_t> block_bits;
+  for (unsigned int lane {0}; lane < num_lanes; ++lane) {
+    const uint64_t bit {uint64_t{1} << lane};
+    for (unsigned int y_begin {0}; y_begin < grid_height; y_begin += rows_per_block) {
+      const unsigned int y_end {std::min(grid_height, y_begin + rows_per_block)};
+      if (f.bernoulli_p() &&
+          BernoulliSkipper::worthwhile(*f.bernoulli_p(), f.bernoulli_precision())) {
+        BernoulliSkipper skipper {*f.bernoulli_p(), first_seed + lane, y_begin / rows_per_block,
+                                  f.bernoulli_precision(), engine};
+        const std::size_t block_begin {index_of(0, y_begin)};
+        const std::size_t block_size {(y_end - y_begin) * grid_width};
+        if (skipper.majority()) {
+          for (std::size_t i {0}; i < block_size; ++i) {
+            open[block_begin + i] |= bit;
+          }
+        }
+        for (std::size_t i {skipper.first()}; i < block_size; i = skipper.next(i)) {
+          open[block_begin + i] ^= bit;
+        }
+        continue;
+      }
+      if (f.bernoulli_p()) {
+        BernoulliStream bits {*f.bernoulli_p(), first_seed + lane, y_begin / rows_per_block,
+                              f.bernoulli_precision(), engine};
+        block_bits.resize((y_end - y_begin) * grid_width);
+        bits.generate(block_bits.data(), block_bits.size());
+        for (std::size_t i {0}; i < block_bits.size(); ++i) {
+          open[index_of(0, y_begin) + i] |= block_bits[i] ? bit : 0;
+        }
+        continue;
+      }
+      RandomStream rng {first_seed + lane, y_begin / rows_per_block, engine};
+      for (unsigned int y {y_begin}; y < y_end; ++y) {
+        for (unsigned int x {0}; x < grid_width; ++x) {
+          if (f(x, y, rng)) {
+            open[index_of(x, y)] |= bit;
+          }
+        }
+      }
+    }
+  }
+}
+
+// Opens each site of each lane with probability p, independently, to the given number of binary
+// digits. This takes whole bitplanes from BernoulliStream, so the lanes are not the same lattices
+// that Lattice::fill() would make with any seed.
+void BitslicedLattice::fill_bernoulli(double p, uint64_t seed, unsigned int precision,
+                                      RandomEngine engine) {
+  BernoulliStream bits {p, seed, 0, precision, engine};
+  bits.generate_bitplanes(open.data(), open.size());
+}
+
+bool BitslicedLattice::is_open(unsigned int lane, unsigned int x, unsigned int y) const {
+  return (open[index_of(x, y)] >> lane) & 1;
+}
+
+// Returns the lanes in which an open path joins the top row to the bottom row, or nothing if
+// aborted (or out of time). How many passes it takes isn't known in advance, so the progress only
+// keeps the time, for the budget.
+//
+// Fluid pours in from the top, and spreads along rows and alternately down and up the lattice,
+// in all lanes at once, until a whole pass changes nothing (or every lane spans).
+std::optional<uint64_t> BitslicedLattice::percolates(Progress &progress) {
+  progress.start(0);
+  std::fill(reached.begin(), reached.end(), 0);
+  std::copy(open.begin(), open.begin() + grid_width, reached.begin());
+  spread_along_row(0);
+  num_words_touched = 0;
+  const std::size_t bottom {index_of(0, grid_height - 1)};
+  auto spanning {
+    [&]() {
+      uint64_t lanes {0};
+      for (std::size_t i {bottom}; i < reached.size(); ++i) {
+        lanes |= reached[i];
+      }
+      return lanes;
+    }};
+
+  bool down {true};
+  while (true) {
+    if (!progress.running()) {
+      return std::nullopt;
+    }
+    const bool changed {down ? spread_down() : spread_up()};
+    num_words_touched += open.size();
+    progress.advance(open.size());
+    if (!changed || spanning() == ~uint64_t{0}) {
+      break;
+    }
+    down = !down;
+  }
+  return spanning();
+}
+
+// The number of site words visited by the last call to percolates().
+std::size_t BitslicedLattice::words_touched() const {
+  return num_words_touched;
+}
+
+// Returns true if anything new was reached.
+bool BitslicedLattice::spread_down() {
+  bool changed {false};
+  for (unsigned int y {1}; y < grid_height; ++y) {
+    const std::size_t row {index_of(0, y)};
+    for (std::size_t i {row}; i < row + grid_width; ++i) {
+      const uint64_t r {reached[i] | (open[i] & reached[i - grid_width])};
+      changed |= r != reached[i];
+      reached[i] = r;
+    }
+    changed |= spread_along_row(y);
+  }
+  return changed;
+}
+
+bool BitslicedLattice::spread_up() {
+  bool changed {false};
+  for (unsigned int y {grid_height - 1}; y-- > 0; ) {
+    const std::size_t row {index_of(0, y)};
+    for (std::size_t i {row}; i < row + grid_width; ++i) {
+      const uint64_t r {reached[i] | (open[i] & reached[i + grid_width])};
+      changed |= r != reached[i];
+      reached[i] = r;
+    }
+    changed |= spread_along_row(y);
+  }
+  return changed;
+}
+
+// One sweep each way reaches everything along the row that can be reached within it.
+bool BitslicedLattice::spread_along_row(unsigned int y) {
+  const std::size_t row {index_of(0, y)};
+  bool changed {false};
+  for (std::size_t i {row + 1}; i < row + grid_width; ++i) {
+    const uint64_t r {reached[i] | (open[i] & reached[i - 1])};
+    changed |= r != reached[i];
+    reached[i] = r;
+  }
+  for (std::size_t i {row + grid_width - 1}; i-- > row; ) {
+    const uint64_t r {reached[i] | (open[i] & reached[i + 1])};
+    changed |= r != reached[i];
+    reached[i] = r;
+  }
+  return changed;
+}
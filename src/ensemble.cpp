@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+
+#include "ensemble.h"
+
+
+// Starts running the job immediately.
+Ensemble::Ensemble(EnsembleJob ensemble_job)
+  : job {ensemble_job}
+  , results {ensemble_job.num_samples}
+{
+  stopwatch.start();
+  const std::size_t num_batches {
+    bitsliced() ? (job.num_samples + BitslicedLattice::num_lanes - 1) / BitslicedLattice::num_lanes
+                : job.num_samples};
+  const std::size_t num_runners {
+    std::min<std::size_t>(ThreadPool::shared().get_num_workers(), num_batches)};
+  for (std::size_t i {0}; i < num_runners; ++i) {
+    runners.push_back(std::make_unique<Runner>());
+  }
+  num_runners_active = num_runners;
+  for (std::size_t i {0}; i < num_runners; ++i) {
+    submit_runner(i);
+  }
+}
+
+// Cancels the job, and waits for the samples in progress to stop.
+Ensemble::~Ensemble() {
+  cancel();
+  std::unique_lock<std::mutex> lock {runners_mutex};
+  runners_finished.wait(lock, [this]() { return num_runners_active == 0; });
+}
+
+void Ensemble::cancel() {
+  running = false;
+  for (auto &runner : runners) {
+    std::unique_lock<std::mutex> lock {runner->mutex};
+    if (runner->sample_run) {
+      *runner->sample_run = false;
+    }
+  }
+}
+
+// Returns true once no samples are being run any more (whether or not they were all done).
+bool Ensemble::done() {
+  std::unique_lock<std::mutex> lock {runners_mutex};
+  return num_runners_active == 0;
+}
+
+// Gets the next result, in the order in which samples were finished, if there is one.
+bool Ensemble::pop_result(SampleResult &result) {
+  return results.pop(result);
+}
+
+std::size_t Ensemble::num_samples_done() {
+  return samples_done;
+}
+
+ProgressReport Ensemble::report() {
+  const std::size_t num_done {samples_done};
+  const double fraction {
+    job.num_samples == 0 ? 1.0 : static_cast<double>(num_done) / job.num_samples};
+  if (num_done == 0) {
+    return {fraction, std::nullopt};
+  }
+  return {fraction, (job.num_samples - num_done) / samples_per_second()};
+}
+
+double Ensemble::samples_per_second() {
+  const double seconds {finish_seconds > 0.0 ? finish_seconds.load() : seconds_elapsed()};
+  return seconds > 0.0 ? samples_done / seconds : 0.0;
+}
+
+double Ensemble::seconds_elapsed() {
+  return stopwatch.elapsed_ms() / 1000.0;
+}
+
+// Whether the job is small and simple enough to run on bit-sliced lattices.
+bool Ensemble::bitsliced() const {
+  constexpr std::size_t max_sites {256 * 256};
+  return job.test_spanning && !job.find_clusters && !job.torus
+    && static_cast<std::size_t>(job.width) * job.height <= max_sites;
+}
+
+void Ensemble::submit_runner(std::size_t runner) {
+  // Low priority: interactive work on the shared pool comes first.
+  ThreadPool::shared().submit([this, runner]() { run_next(runner); }, TaskPriority::low);
+}
+
+// Runs the runner's next sample (or batch of samples), and submits the runner again if there are
+// more to do.
+void Ensemble::run_next(std::size_t runner) {
+  Runner &r {*runners[runner]};
+  bool more {false};
+  try {
+    more = bitsliced() ? run_next_bitsliced_batch(r) : run_next_sample(r);
+  } catch (std::bad_alloc& ba) {
+    cancel();
+  }
+  if (more) {
+    submit_runner(runner);
+  } else {
+    r.lattice.reset();
+    r.bitsliced_lattice.reset();
+    finish_runner();
+  }
+}
+
+// Each runner takes the next sample to be done, on its own lattice. Returns false if there was
+// none left (or the job was cancelled).
+bool Ensemble::run_next_sample(Runner &runner) {
+  if (!running) {
+    return false;
+  }
+  const std::size_t sample {next_sample++};
+  if (sample >= job.num_samples) {
+    return false;
+  }
+  if (!runner.lattice) {
+    runner.lattice = std::make_unique<Lattice>(job.width, job.height);
+    runner.lattice->set_torus(job.torus);
+  }
+  std::atomic_bool run {true};
+  if (!begin_sample(runner, run)) {
+    return false;
+  }
+  results.push(run_sample(*runner.lattice, job.first_seed + sample, run));
+  end_sample(runner);
+  ++samples_done;
+  return true;
+}
+
+// Like run_next_sample(), but 64 samples at a time. They share a time budget.
+bool Ensemble::run_next_bitsliced_batch(Runner &runner) {
+  constexpr std::size_t num_lanes {BitslicedLattice::num_lanes};
+  if (!running) {
+    return false;
+  }
+  const std::size_t first_sample {next_sample.fetch_add(num_lanes)};
+  if (first_sample >= job.num_samples) {
+    return false;
+  }
+  if (!runner.bitsliced_lattice) {
+    runner.bitsliced_lattice = std::make_unique<BitslicedLattice>(job.width, job.height);
+  }
+  BitslicedLattice &lattice {*runner.bitsliced_lattice};
+  const std::size_t num_in_batch {std::min(num_lanes, job.num_samples - first_sample)};
+  Stopwatch batch_stopwatch;
+  batch_stopwatch.start();
+  std::atomic_bool run {true};
+  if (!begin_sample(runner, run)) {
+    return false;
+  }
+  std::optional<uint64_t> spanning;
+  Progress progress {run};
+  const uint64_t first_seed {job.first_seed + first_sample};
+  if (job.measure.bernoulli_p()) {
+    lattice.fill_bernoulli(*job.measure.bernoulli_p(), first_seed,
+                           job.measure.bernoulli_precision(), job.engine);
+  } else {
+    lattice.fill(job.measure, first_seed, job.engine);
+  }
+  // The search gets whatever is left of the budget after the fill.
+  const double seconds_left {job.time_budget - batch_stopwatch.elapsed_ms() / 1000.0};
+  if (job.time_budget <= 0.0 || seconds_left > 0.0) {
+    progress.set_time_budget(job.time_budget <= 0.0 ? 0.0 : seconds_left);
+    spanning = lattice.percolates(progress);
+  }
+  end_sample(runner);
+  const double seconds {batch_stopwatch.elapsed_ms() / 1000.0 / num_in_batch};
+  for (std::size_t lane {0}; lane < num_in_batch; ++lane) {
+    SampleResult result {job.first_seed + first_sample + lane, job.engine, false,
+                         std::nullopt, 0, 0, seconds};
+    if (job.measure.bernoulli_p()) {
+      result.seed = first_seed;
+      result.lane = lane;
+    }
+    if (spanning) {
+      // The search only counts the words it visited for the whole batch, not the sites per lane.
+      result.complete = true;
+      result.spanning = SpanningResult {((*spanning >> lane) & 1) != 0, 0};
+    }
+    results.push(result);
+  }
+  samples_done += num_in_batch;
+  return true;
+}
+
+// Lets cancel() stop the runner's sample in progress through run. Returns false, and the sample
+// must not be run, if the job was cancelled already.
+bool Ensemble::begin_sample(Runner &runner, std::atomic_bool &run) {
+  // cancel() clears running before it looks at the runners, so either it finds run here, or run
+  // isn't set here.
+  std::unique_lock<std::mutex> lock {runner.mutex};
+  if (!running) {
+    return false;
+  }
+  runner.sample_run = &run;
+  return true;
+}
+
+void Ensemble::end_sample(Runner &runner) {
+  std::unique_lock<std::mutex> lock {runner.mutex};
+  runner.sample_run = nullptr;
+}
+
+void Ensemble::finish_runner() {
+  std::unique_lock<std::mutex> lock {runners_mutex};
+  if (--num_runners_active == 0) {
+    finish_seconds = seconds_elapsed();
+  }
+  runners_finished.notify_all();
+}
+
+SampleResult Ensemble::run_sample(Lattice &lattice, uint64_t seed, std::atomic_bool &run) {
+  SampleResult result {seed, job.engine, false, std::nullopt, 0, 0, 0.0};
+  Stopwatch sample_stopwatch;
+  sample_stopwatch.start();
+  Progress progress {run};
+  // Each operation gets whatever is left of the sample's time budget. Once it runs out, or the job
+  // is cancelled, run is false for good.
+  auto budget_left {
+    [&]() -> bool {
+      if (!run) {
+        return false;
+      }
+      if (job.time_budget <= 0.0) {
+        return true;
+      }
+      const double seconds_left {job.time_budget - sample_stopwatch.elapsed_ms() / 1000.0};
+      progress.set_time_budget(seconds_left);
+      return seconds_left > 0.0;
+    }};
+
+  auto finish {
+    [&]() {
+      result.seconds = sample_stopwatch.elapsed_ms() / 1000.0;
+      return result;
+    }};
+  if (!budget_left()) {
+    return finish();
+  }
+  lattice.fill(job.measure, seed, progress, job.engine);
+  if (!run) {
+    return finish();
+  }
+  if (job.test_spanning) {
+    if (!budget_left()) {
+      return finish();
+    }
+    result.spanning = lattice.percolates(true, progress);
+    if (!result.spanning) {
+      return finish();
+    }
+  }
+  if (job.find_clusters) {
+    if (!budget_left()) {
+      return finish();
+    }
+    lattice.find_clusters(progress);
+    if (!run) {
+      return finish();
+    }
+    result.num_clusters = lattice.num_clusters();
+    const auto counts {lattice.cluster_size_counts()};
+    result.largest_cluster_size = counts.empty() ? 0 : counts.size() - 1;
+  }
+  result.complete = true;
+  return finish();
+}
@@ -0,0 +1,145 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "utility.h"
+#include "lattice.h"
+#include "bitslicedlattice.h"
+
+
+// A batch of independent samples: lattices of the same size and measure, filled with consecutive
+// seeds, each of which goes through the same operations.
+struct EnsembleJob {
+  unsigned int width {1};
+  unsigned int height {1};
+  measure::filler measure {measure::open()};
+  bool torus {false};
+  uint64_t first_seed {0};
+  RandomEngine engine {default_random_engine};
+  std::size_t num_samples {0};
+
+  // Operations
+  bool test_spanning {true};
+  bool find_clusters {false};
+
+  double time_budget {0.0};  // Seconds per sample, or 0 for no limit
+};
+
+// The seed and engine are enough to make the sample again with Lattice::fill(), unless lane is
+// set. Then the sample is that lane of the bit-sliced batch that BitslicedLattice::fill_bernoulli()
+// makes from the seed (see Ensemble), and spanning->sites_touched isn't known, so it's 0.
+struct SampleResult {
+  uint64_t seed;
+  RandomEngine engine;
+  bool complete;  // False if the sample ran out of time (the rest of the fields may be missing)
+  std::optional<SpanningResult> spanning;
+  unsigned int num_clusters;
+  std::size_t largest_cluster_size;
+  double seconds;
+  std::optional<unsigned int> lane {std::nullopt};
+};
+
+// A fixed-capacity queue that any number of threads may push to, and one thread may pop from,
+// without locking. Items are popped in the order in which their pushes began.
+template <typename T>
+class ResultQueue {
+public:
+  explicit ResultQueue(std::size_t capacity)
+    : slots(capacity) {}
+
+  // There must be room left.
+  void push(T item) {
+    Slot &slot {slots[write_position++]};
+    slot.item = std::move(item);
+    slot.ready.store(true, std::memory_order_release);
+  }
+
+  // Returns false if the next item isn't ready yet.
+  bool pop(T &item) {
+    if (read_position == slots.size() ||
+        !slots[read_position].ready.load(std::memory_order_acquire)) {
+      return false;
+    }
+    item = std::move(slots[read_position++].item);
+    return true;
+  }
+
+private:
+  struct Slot {
+    T item;
+    std::atomic_bool ready {false};
+  };
+  std::vector<Slot> slots;
+  std::atomic_size_t write_position {0};
+  std::size_t read_position {0};  // Only touched by the popping thread
+};
+
+// Runs an EnsembleJob on the shared thread pool, one sample per worker at a time. Each runner
+// reuses its own lattice, and runs one sample per task, and then submits a task for the next one,
+// so that other work on the pool never waits for more than a sample. All member functions return
+// immediately; results are streamed back through pop_result(), which must always be called from
+// the same thread.
+//
+// Jobs that only test small rectangles for spanning are run 64 samples at a time instead, on
+// bit-sliced lattices. If the measure is Bernoulli, a whole batch is filled from one seed, which
+// no Lattice can reproduce sample by sample: those results give the batch's seed and their lane.
+class Ensemble {
+public:
+  explicit Ensemble(EnsembleJob ensemble_job);
+  ~Ensemble();
+
+  Ensemble() =delete;
+  Ensemble(const Ensemble&) =delete;
+  Ensemble& operator=(const Ensemble&) =delete;
+
+  void cancel();
+  bool done();
+  bool pop_result(SampleResult &result);
+  std::size_t num_samples_done();
+  ProgressReport report();
+  double samples_per_second();
+
+private:
+  // Each sample (or batch) has a run flag of its own, which only its time budget and cancel() ever
+  // clear. The runner points to it while the sample is in progress, so that cancel() can find it.
+  struct Runner {
+    std::mutex mutex;
+    std::atomic_bool* sample_run {nullptr};  // Guarded by mutex
+    std::unique_ptr<Lattice> lattice;
+    std::unique_ptr<BitslicedLattice> bitsliced_lattice;
+  };
+
+  bool bitsliced() const;
+  void submit_runner(std::size_t runner);
+  void run_next(std::size_t runner);
+  bool run_next_sample(Runner &runner);
+  bool run_next_bitsliced_batch(Runner &runner);
+  bool begin_sample(Runner &runner, std::atomic_bool &run);
+  void end_sample(Runner &runner);
+  void finish_runner();
+  SampleResult run_sample(Lattice &lattice, uint64_t seed, std::atomic_bool &run);
+  double seconds_elapsed();
+
+  const EnsembleJob job;
+  ResultQueue<SampleResult> results;
+  Stopwatch stopwatch;
+
+  std::atomic_bool running {true};
+  std::vector<std::unique_ptr<Runner>> runners;
+  std::atomic_size_t next_sample {0};
+  std::atomic_size_t samples_done {0};
+  std::size_t num_runners_active {0};
+  std::mutex runners_mutex;
+  std::condition_variable runners_finished;
+  std::atomic<double> finish_seconds {0.0};  // Time taken by the whole job, once it's done
+};
+
+
+#endif  // ENSEMBLE_H
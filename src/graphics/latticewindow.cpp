@@ -1,7 +1,10 @@
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
 #include <cmath>
 #include <cstdint>
+#include <cstdio>
+#include <span>
 #include <string>
 #include <thread>
 
@@ -179,6 +182,8 @@ void LatticeWindow::show(bool &visible) {
     }
     ImGui::SameLine();
     ImGui::Text("Rendering...");
+    ImGui::SameLine();
+    progress_bar(painting_progress.report());
   } else {
     ImGui::Text("Scale: %.0f%% (scroll to zoom; drag to pan)", 100.0F / zoom_scale);
     ImGui::SameLine();
@@ -222,24 +227,30 @@ void LatticeWindow::paint_texture_data(const Lattice* data) {
   IM_ASSERT(data != nullptr);
 
   painting = true;
+  // Measured in sites painted.
+  painting_progress.start(
+    static_cast<std::size_t>(data->get_width()) * data->get_height() + data->num_cluster_sites());
   unsigned int width {data->get_width()};
   unsigned int height {data->get_height()};
 
   // Textures can be very large: No point in reallocating unless the size has changed.  We use two
   // buffers so that rendering can be done in parallel with sending to the GPU. This is important
   // during "flowing" mode.
+  // The texture data is laid out like the lattice's grid, border included, so that site indices
+  // can be used as pixel indices. The border is skipped when sending the texture to the GPU.
   texture_data_mutex.lock();
   if (width != texture_data_width or
       height != texture_data_height or
       texture_data == nullptr) {
     delete[] texture_data;
-    texture_data = new uint32_t[width * height];
+    texture_data = new uint32_t[data->grid_size()];
     texture_data_width = width;
     texture_data_height = height;
+    texture_data_stride = data->grid_stride();
     texture_data_mutex.unlock();
 
     delete[] texture_data_painting;
-    texture_data_painting = new uint32_t[width * height];
+    texture_data_painting = new uint32_t[data->grid_size()];
   } else {
     texture_data_mutex.unlock();
   }
@@ -255,25 +266,38 @@ void LatticeWindow::paint_texture_data(const Lattice* data) {
   constexpr uint32_t cyan = 0x2CCDFFFF;
   constexpr uint32_t black = 0x000000FF;
   constexpr uint32_t white = 0xFFFFFFFF;
-  data->for_each_site(
-    [&] (const int x, const int y) {
-      uint32_t site_color {white};
-      Site site {data->get_site(x, y)};
-      if (site.open) {
-        if (site.flooded) {
-          if (site.fresh) {
-            site_color = cyan;
+  data->for_each_row(
+    [&] (const int y, const Site* row) {
+      uint32_t* pixels {texture_data_painting + data->index_of(0, y)};
+      for (unsigned int tile_x {0}; tile_x < data->num_tiles_across(); ++tile_x) {
+        const unsigned int x_begin {tile_x * Lattice::tile_size};
+        const unsigned int x_end {std::min(x_begin + Lattice::tile_size, width)};
+        if (data->tile_occupancy(tile_x, y / Lattice::tile_size) == TileOccupancy::closed) {
+          // All grey: one solid run.
+          std::fill(pixels + x_begin, pixels + x_end, grey);
+          continue;
+        }
+        for (unsigned int x {x_begin}; x < x_end; ++x) {
+          uint32_t site_color {white};
+          const Site site {row[x]};
+          if (site.open) {
+            if (site.flooded) {
+              if (site.fresh) {
+                site_color = cyan;
+              } else {
+                site_color = blue;
+              }
+            } else {
+              site_color = white;
+            }
           } else {
-            site_color = blue;
+            // Site is closed
+            site_color = grey;
           }
-        } else {
-          site_color = white;
+          pixels[x] = site_color;
         }
-      } else {
-        // Site is closed
-        site_color = grey;
       }
-      texture_data_painting[y*width + x] = site_color;
+      painting_progress.advance(width);
     }, painting);
 
   // Overlay clusters, if any.
@@ -285,11 +309,12 @@ void LatticeWindow::paint_texture_data(const Lattice* data) {
       return c + cluster_color_increment;
     }};
   data->for_each_cluster(
-    [&] (const Cluster &cluster) {
+    [&] (std::span<const SiteIndex> cluster) {
       for (const auto site : cluster) {
-        texture_data_painting[site.y * width + site.x] = cluster_color;
+        texture_data_painting[site] = cluster_color;
       }
       cluster_color = next_color(cluster_color);
+      painting_progress.advance(cluster.size());
     }, painting);
 
   if (painting) {  // Unless aborted
@@ -317,19 +342,25 @@ void LatticeWindow::send_texture_data() {
   // shrinking a texture to fit, so that it looks nicer. Speed isn't an issue here.
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 
   // TODO When downsampling, we can get a Moire pattern. So do our own interpolation, instead.
   // TODO This is quite slow for large textures, and sometimes causes a noticeable delay. But to
   // call this in a separate thread, we have to figure out how context management works in OpenGL.
   // TODO Try glTexSubImage2D to copy without allocating?
   texture_data_mutex.lock();
+  // Skip the border (see paint_texture_data()).
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, texture_data_stride);
+  glPixelStorei(GL_UNPACK_SKIP_ROWS, 1);
+  glPixelStorei(GL_UNPACK_SKIP_PIXELS, 1);
   glTexImage2D(
     GL_TEXTURE_2D, 0, GL_RGBA,
     texture_data_width,
     texture_data_height,
     0, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8,
     texture_data);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+  glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
   IM_ASSERT(glIsTexture(gl_texture));
   gl_texture_width = texture_data_width;
   gl_texture_height = texture_data_height;
@@ -337,6 +368,14 @@ void LatticeWindow::send_texture_data() {
   texture_data_mutex.unlock();
 }
 
+void progress_bar(const ProgressReport &progress) {
+  char overlay[32] {""};
+  if (progress.seconds_left) {
+    std::snprintf(overlay, sizeof(overlay), "%.0f s left", std::ceil(*progress.seconds_left));
+  }
+  ImGui::ProgressBar(progress.fraction_done, ImVec2(ImGui::GetFontSize() * 10.0F, 0.0F), overlay);
+}
+
 void LatticeWindow::reset_view() {
   zoom_level = 0;
   zoom_scale = 1.0F;
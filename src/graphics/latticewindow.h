@@ -10,8 +10,12 @@
 #include "imgui/imgui.h"
 
 #include "lattice.h"
+#include "utility.h"
 
 
+// Shows a small progress bar, labeled with the estimated time left.
+void progress_bar(const ProgressReport &progress);
+
 class LatticeWindow {
 public:
   LatticeWindow(const std::string &title);
@@ -42,6 +46,7 @@ private:
 
   std::atomic_bool running {true};
   std::atomic_bool painting {false};
+  Progress painting_progress {painting};
   std::thread worker_thread;
   std::condition_variable worker_cond;
 
@@ -55,6 +60,7 @@ private:
   uint32_t* texture_data_painting {nullptr};
   int texture_data_width {0};
   int texture_data_height {0};
+  int texture_data_stride {0};
   std::atomic_bool texture_data_wraparound {false};
   std::atomic_bool texture_data_ready {false};
 
@@ -0,0 +1,137 @@
+#include <cassert>
+#include <functional>
+#include <queue>
+#include <tuple>
+#include <utility>
+
+#include "invasion.h"
+
+
+StrengthQueue::StrengthQueue(std::size_t num_sites, unsigned int key_bits)
+  : heads(std::size_t {1} << key_bits, end_of_list)
+  , next(num_sites, never_pushed)
+{
+  assert(num_sites < popped);
+  std::size_t num_bits {heads.size()};
+  do {
+    const std::size_t num_words {(num_bits + 63) / 64};
+    levels.emplace_back(num_words, 0);
+    num_bits = num_words;
+  } while (num_bits > 1);
+}
+
+void StrengthQueue::push(uint32_t strength, uint32_t site) {
+  assert(strength < heads.size() && !was_pushed(site));
+  uint32_t &head {heads[strength]};
+  const bool was_empty {head == end_of_list};
+  next[site] = head;
+  head = site;
+  ++count;
+  if (was_empty) {
+    // Mark the bucket in use, and each word above it, up to the first that was in use already.
+    std::size_t bit {strength};
+    for (auto &level : levels) {
+      uint64_t &word {level[bit / 64]};
+      const bool was_in_use {word != 0};
+      word |= uint64_t {1} << (bit % 64);
+      if (was_in_use) {
+        break;
+      }
+      bit /= 64;
+    }
+  }
+}
+
+uint32_t StrengthQueue::pop() {
+  assert(count > 0);
+  // Descend from the top level, taking the first bit in use at each.
+  std::size_t bucket {0};
+  for (auto level {levels.rbegin()}; level != levels.rend(); ++level) {
+    bucket = bucket * 64 + std::countr_zero((*level)[bucket]);
+  }
+  uint32_t &head {heads[bucket]};
+  const uint32_t site {head};
+  head = next[site];
+  next[site] = popped;
+  --count;
+  if (head == end_of_list) {
+    // Unmark the bucket, and each word above it that's no longer in use.
+    std::size_t bit {bucket};
+    for (auto &level : levels) {
+      uint64_t &word {level[bit / 64]};
+      word &= ~(uint64_t {1} << (bit % 64));
+      if (word != 0) {
+        break;
+      }
+      bit /= 64;
+    }
+  }
+  return site;
+}
+
+bool check_strength_queue_ties(uint64_t seed, unsigned int key_bits) {
+  constexpr uint32_t num_sites {1 << 16};
+  StrengthQueue queue {num_sites, key_bits};
+  // Entries are (strength, -push number, site), so the smallest is the weakest, newest push.
+  using Entry = std::tuple<uint32_t, int64_t, uint32_t>;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> reference;
+  RandomStream rng {seed, 0};
+  int64_t num_pushed {0};
+  uint32_t next_site {0};
+  while (next_site < num_sites || !reference.empty()) {
+    // Push two sites for each one popped, on average, until they run out.
+    if (next_site < num_sites && (reference.empty() || rng.next() % 3 != 0)) {
+      const uint32_t strength {static_cast<uint32_t>(rng.next() >> (64 - key_bits))};
+      queue.push(strength, next_site);
+      reference.emplace(strength, -num_pushed++, next_site);
+      ++next_site;
+    } else {
+      if (queue.empty() || queue.pop() != std::get<2>(reference.top())) {
+        return false;
+      }
+      reference.pop();
+    }
+  }
+  return queue.empty();
+}
+
+DisjointSets::DisjointSets(std::size_t num_sites)
+  : parent(num_sites, absent)
+  , rank(num_sites, 0)
+  , escape(num_sites, 0)
+{}
+
+void DisjointSets::add(uint32_t site, bool is_escape) {
+  parent[site] = site;
+  escape[site] = is_escape;
+}
+
+// With path halving.
+uint32_t DisjointSets::find(uint32_t site) {
+  while (parent[site] != site) {
+    parent[site] = parent[parent[site]];
+    site = parent[site];
+  }
+  return site;
+}
+
+// By rank.
+void DisjointSets::unite(uint32_t a, uint32_t b) {
+  uint32_t root_a {find(a)};
+  uint32_t root_b {find(b)};
+  if (root_a == root_b) {
+    return;
+  }
+  if (rank[root_a] < rank[root_b]) {
+    std::swap(root_a, root_b);
+  }
+  parent[root_b] = root_a;
+  escape[root_a] |= escape[root_b];
+  if (rank[root_a] == rank[root_b]) {
+    ++rank[root_a];
+  }
+}
+
+bool DisjointSets::escapes(uint32_t site) {
+  return escape[find(site)];
+}
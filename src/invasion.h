@@ -0,0 +1,90 @@
+#ifndef INVASION_H
+#define INVASION_H
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "random.h"
+
+
+// The parts of invasion percolation that don't depend on the lattice: random site strengths, the
+// queue of the sites on the invader's perimeter, and the disjoint sets used to find trapped sites.
+// Sites are identified by their index in the grid, as in Lattice (a SiteIndex).
+
+// Strengths are quantized to this many bits, so that a strength can index a bucket, and the
+// buckets' heads still fit in a 1 MiB cache. On big lattices, sites of equal strength are common
+// (a lattice of 10^8 sites has some 380 at each level), so how ties are broken is part of the
+// model: among sites of equal strength, the last one pushed is taken first (see StrengthQueue).
+constexpr unsigned int strength_bits {18};
+
+// The strength of a site, as a uniform random number below 2^strength_bits. It depends only on the
+// key (see strength_key()) and the site, and is worked out when needed, so strengths take no
+// memory.
+inline uint64_t strength_key(uint64_t seed) {
+  return RandomStream::splitmix64(RandomStream::splitmix64(seed));
+}
+inline uint32_t site_strength(uint64_t key, uint32_t site) {
+  return static_cast<uint32_t>(RandomStream::splitmix64(key + site) >> (64 - strength_bits));
+}
+
+// A priority queue of sites by strength, weakest first, into which each site may be pushed only
+// once. There's a bucket of sites for each strength, and a bitmap of the buckets in use,
+// summarized in levels of 64-bit words (a bit per word of the level below), so that the first
+// bucket in use is found by looking at one word per level. Pushing and popping take constant time
+// whatever the strengths, and unlike a binary heap, no sites are moved around.
+//
+// A bucket is a list linked through an array with an entry per site, rather than a vector of its
+// own: a push then touches only its bucket's head and the site's own entry (which is usually near
+// the sites just visited), and never allocates. Within a bucket, the last site in is the first out.
+class StrengthQueue {
+public:
+  StrengthQueue(std::size_t num_sites, unsigned int key_bits = strength_bits);
+
+  bool empty() const { return count == 0; }
+  std::size_t size() const { return count; }
+  bool was_pushed(uint32_t site) const { return next[site] != never_pushed; }
+  void push(uint32_t strength, uint32_t site);  // Only if it was never pushed before
+  uint32_t pop();  // Not if empty
+
+private:
+  static constexpr uint32_t end_of_list {UINT32_MAX};
+  static constexpr uint32_t never_pushed {UINT32_MAX - 1};
+  static constexpr uint32_t popped {UINT32_MAX - 2};
+
+  std::vector<uint32_t> heads;  // Of each bucket's list
+  std::vector<uint32_t> next;  // The next site in the list of each site, or one of the above
+  // levels[0] has a bit for each bucket, and each level above it a bit for each word of the one
+  // below. The top level is a single word.
+  std::vector<std::vector<uint64_t>> levels;
+  std::size_t count {0};
+};
+
+// Pushes random sites with random strengths of only key_bits bits, so that ties are common, and
+// pops them at random moments, on a StrengthQueue and on a std::priority_queue ordered by strength
+// and then by the newest push. Returns whether the two always popped the same site.
+bool check_strength_queue_ties(uint64_t seed, unsigned int key_bits);
+
+// Disjoint sets of sites, for the reverse union-find that finds trapped sites. A site belongs to no
+// set until added. Each set knows whether any of its sites is an escape (for the defending fluid).
+class DisjointSets {
+public:
+  explicit DisjointSets(std::size_t num_sites);
+
+  bool contains(uint32_t site) const { return parent[site] != absent; }
+  void add(uint32_t site, bool is_escape);
+  void unite(uint32_t a, uint32_t b);
+  bool escapes(uint32_t site);
+
+private:
+  static constexpr uint32_t absent {UINT32_MAX};
+  uint32_t find(uint32_t site);
+
+  std::vector<uint32_t> parent;
+  std::vector<uint8_t> rank;  // Of each set, at its root
+  std::vector<uint8_t> escape;  // Of each set, at its root
+};
+
+
+#endif  // INVASION_H
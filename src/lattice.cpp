@@ -2,17 +2,23 @@
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <cmath>
 #include <cstdint>
 #include <cstring>
-#ifdef HAVE_TBB
-#include <execution>
-#endif
 #include <functional>
 #include <limits>
+#include <numeric>
+#include <thread>
 
 #include "lattice.h"
+#include "bernoulli.h"
+#include "invasion.h"
+#include "utility.h"
 
 
+// fill(), and the passes that follow its blocks, work on this many rows at a time.
+static constexpr std::size_t rows_per_block {Lattice::fill_block_rows};
+
 // The constructor allocates but does not initialize the lattice. You must call fill() on a
 // Lattice object after creating it.
 Lattice::Lattice (unsigned int width, unsigned int height)
@@ -20,6 +26,7 @@ Lattice::Lattice (unsigned int width, unsigned int height)
   , grid_width {width}
   , grid_height {height}
   , begun_percolation {false}
+  , maybe_flooded {false}
   , flow_direction {FlowDirection::all_sides}
 {
   assert(sizeof(Site) == 1);
@@ -28,7 +35,7 @@ Lattice::Lattice (unsigned int width, unsigned int height)
 
 Lattice::~Lattice() {
   clear_clusters();
-  delete[] grid;
+  free_pages(grid, grid_size());
 }
 
 // Copy constructor
@@ -36,21 +43,52 @@ Lattice::Lattice (const Lattice& rhs)
   : grid_width {rhs.grid_width}
   , grid_height {rhs.grid_height}
   , begun_percolation {rhs.begun_percolation}
+  , maybe_flooded {rhs.maybe_flooded}
   , flow_direction {rhs.flow_direction}
   , torus {rhs.torus}
   , freshly_flooded {rhs.freshly_flooded}
-  , current_cluster {rhs.current_cluster}
+  , record_flood_times {rhs.record_flood_times}
+  , flow_step {rhs.flow_step}
+  , recorded_flow_steps {rhs.recorded_flow_steps}
+  , clusters {rhs.clusters}
+  , size_counts {rhs.size_counts}
+  , largest_clusters {rhs.largest_clusters}
+  , num_largest_clusters {rhs.num_largest_clusters}
+  , flow_model {rhs.flow_model}
+  , trapping {rhs.trapping}
+  , strength_key {rhs.strength_key}
 {
-  allocate_grid();
-  std::memcpy(grid, rhs.grid, grid_width * grid_height);
-  for (auto rhs_cluster : rhs.clusters) {
-    Cluster* cluster = new Cluster(*rhs_cluster);
-    clusters.emplace_back(cluster);
-  }
+  std::atomic_bool run {true};
+  Progress progress {run};
+  copy_contents(rhs, progress);
+}
+
+// Abortable copy constructor. If it's cancelled partway through, the copy is left incomplete: it
+// is safe to destroy, but must not be used for anything else.
+Lattice::Lattice (const Lattice& rhs, Progress &progress)
+  : grid_width {rhs.grid_width}
+  , grid_height {rhs.grid_height}
+  , begun_percolation {rhs.begun_percolation}
+  , maybe_flooded {rhs.maybe_flooded}
+  , flow_direction {rhs.flow_direction}
+  , torus {rhs.torus}
+  , freshly_flooded {rhs.freshly_flooded}
+  , record_flood_times {rhs.record_flood_times}
+  , flow_step {rhs.flow_step}
+  , recorded_flow_steps {rhs.recorded_flow_steps}
+  , clusters {rhs.clusters}
+  , size_counts {rhs.size_counts}
+  , largest_clusters {rhs.largest_clusters}
+  , num_largest_clusters {rhs.num_largest_clusters}
+  , flow_model {rhs.flow_model}
+  , trapping {rhs.trapping}
+  , strength_key {rhs.strength_key}
+{
+  copy_contents(rhs, progress);
 }
 
 void Lattice::resize(const unsigned int width, const unsigned int height) {
-  delete[] grid;
+  free_pages(grid, grid_size());
   grid = nullptr;
   grid_width = width;
   grid_height = height;
@@ -58,7 +96,10 @@ void Lattice::resize(const unsigned int width, const unsigned int height) {
   allocate_grid();
   clear_clusters();
   freshly_flooded.clear();
+  flood_times.clear();
   begun_percolation = false;
+  maybe_flooded = false;
+  forget_invasion();
 }
 
 unsigned int Lattice::get_width() const { return grid_width; }
@@ -69,49 +110,181 @@ FlowDirection Lattice::get_flow_direction() {
 }
 
 void Lattice::set_flow_direction(FlowDirection direction) {
+  if (direction != flow_direction) {
+    forget_flood_times_after(begun_percolation ? flow_step : 0);
+    forget_invasion();
+  }
   this->flow_direction = direction;
 }
 
+FlowModel Lattice::get_flow_model() const {
+  return flow_model;
+}
+
+// In invasion percolation, each site has a random strength, and the invader takes the weakest open
+// site on its perimeter, one site per step, starting from the entryways. Flowing from the top of a
+// rectangle, the invasion ends when it breaks through to the bottom row; otherwise it goes on until
+// it has taken every site it can reach.
+//
+// Strengths come in 2^strength_bits levels (see invasion.h), so on big lattices many sites share
+// one: at 10^8 sites, some 380 per level. Among perimeter sites of equal strength, the one that
+// joined the perimeter last is taken first. That tie-break is part of the model, not an accident
+// of the queue, and check_strength_queue_ties() checks it.
+//
+// Reset the percolation after changing the model: a flow can't switch models midway.
+void Lattice::set_flow_model(FlowModel model) {
+  flow_model = model;
+}
+
+// With trapping, the invader can't take sites that the defending fluid (which can't be compressed)
+// has no way out from: regions cut off from the bottom row. This only applies to an invasion from
+// the top of a rectangle, where the bottom row is the way out.
+void Lattice::set_trapping(bool is_trapping) {
+  if (is_trapping != trapping) {
+    trapping = is_trapping;
+    forget_invasion();
+  }
+}
+
 void Lattice::set_torus(bool is_torus) {
-  torus = is_torus;
+  if (is_torus != torus) {
+    forget_flood_times_after(begun_percolation ? flow_step : 0);
+    torus = is_torus;
+    update_border();
+    forget_invasion();
+  }
 }
 
 bool Lattice::is_torus() const {
   return torus;
 }
 
-// Xorshift: Fast RNG. Copied from <https://en.wikipedia.org/wiki/Xorshift>.
-// TODO get rid of this: 32 bits isn't enough for what we're doing.
-uint32_t xorshift32() {
-	// Algorithm "xor" from p. 4 of Marsaglia, "Xorshift RNGs"
-  // TODO Seed with system clock.
-	static uint32_t state {1};  // Must be initialized to nonzero.
-	state ^= state << 13;
-	state ^= state >> 17;
-	state ^= state << 5;
-	return state;
-}
-// uint32_t xorshift128() {
-// 	// Algorithm "xor128" from p. 5 of Marsaglia, "Xorshift RNGs"
-//   // The state must be initialized to not be all zero
-//   static uint32_t a {10}, b {20}, c {30}, d {40};
-// 	uint32_t t = d;
-
-// 	uint32_t const s = a;
-// 	d = c;
-// 	c = b;
-// 	b = s;
-
-// 	t ^= t << 11;
-// 	t ^= t >> 8;
-// 	return a = t ^ s ^ (s >> 19);
-// }
+// Returns the byte that represents a site, for operating on all of its fields at once.
+static inline unsigned char site_bits(Site site) {
+  unsigned char bits;
+  std::memcpy(&bits, &site, sizeof(bits));
+  return bits;
+}
+
+// Returns the bit of a site byte that holds the field set by set_field.
+static unsigned char site_field_bit(void (*set_field)(Site &)) {
+  Site site;
+  std::memset(&site, 0, sizeof(site));
+  set_field(site);
+  return site_bits(site);
+}
+
+// Atomically marks an open, unflooded site as flooded and fresh. Returns true if this call is the
+// one that flooded it, so that concurrent callers never claim the same site twice.
+static inline bool claim_site_atomically(Site* site) {
+  static const unsigned char open_bit {site_field_bit([](Site &s) { s.open = true; })};
+  static const unsigned char flooded_bit {site_field_bit([](Site &s) { s.flooded = true; })};
+  static const unsigned char fresh_bit {site_field_bit([](Site &s) { s.fresh = true; })};
+  std::atomic_ref<unsigned char> bits {*reinterpret_cast<unsigned char*>(site)};
+  const unsigned char seen {bits.load(std::memory_order_relaxed)};
+  if (!(seen & open_bit) || (seen & flooded_bit)) {
+    return false;
+  }
+  const unsigned char before {bits.fetch_or(flooded_bit | fresh_bit, std::memory_order_relaxed)};
+  return !(before & flooded_bit);
+}
+
+static inline void unfresh_site_atomically(Site* site) {
+  static const unsigned char fresh_bit {site_field_bit([](Site &s) { s.fresh = true; })};
+  std::atomic_ref<unsigned char> bits {*reinterpret_cast<unsigned char*>(site)};
+  bits.fetch_and(static_cast<unsigned char>(~fresh_bit), std::memory_order_relaxed);
+}
+
+// Boundary policies for the flow kernels, which are specialized for each at compile time. A
+// policy's enter() gives the site reached by a move to grid index i; wrap is the offset that leads
+// from a ghost to the site it mirrors (see Lattice). enter_concurrently() does the same while
+// other threads may be flooding sites.
+struct OpenEdges {
+  static SiteIndex enter(const Site*, SiteIndex i, SiteIndex) {
+    return i;  // The border is closed.
+  }
+  static SiteIndex enter_concurrently(const Site*, SiteIndex i, SiteIndex) {
+    return i;
+  }
+};
+struct TorusEdges {
+  static SiteIndex enter(const Site* grid, SiteIndex i, SiteIndex wrap) {
+    // Unsigned arithmetic wraps around, so negative offsets work.
+    return i + wrap * grid[i].ghost;
+  }
+  // The ghost flag shares its byte with the flooded and fresh flags, which other threads may be
+  // setting (see claim_site_atomically()), so the byte must be read atomically too.
+  static SiteIndex enter_concurrently(const Site* grid, SiteIndex i, SiteIndex wrap) {
+    static const unsigned char ghost_bit {site_field_bit([](Site &s) { s.ghost = true; })};
+    std::atomic_ref<unsigned char> bits {*reinterpret_cast<unsigned char*>(
+      const_cast<Site*>(grid + i))};
+    return i + wrap * ((bits.load(std::memory_order_relaxed) & ghost_bit) != 0);
+  }
+};
+
+// Index offsets between neighboring sites of a grid.
+struct NeighborOffsets {
+  NeighborOffsets(unsigned int width, unsigned int height)
+    : stride {width + 2}
+    , wrap_vertical {height * (width + 2)}
+    , wrap_horizontal {width}
+    {}
+  SiteIndex stride;
+  SiteIndex wrap_vertical;
+  SiteIndex wrap_horizontal;
+};
+
+template <typename Boundary, typename F>
+static inline void for_each_neighbor(
+    const Site* grid, SiteIndex i, const NeighborOffsets &offsets, F f) {
+  f(Boundary::enter(grid, i - offsets.stride, offsets.wrap_vertical));
+  f(Boundary::enter(grid, i + offsets.stride, -offsets.wrap_vertical));
+  f(Boundary::enter(grid, i - 1, offsets.wrap_horizontal));
+  f(Boundary::enter(grid, i + 1, -offsets.wrap_horizontal));
+}
+
+// The same, for kernels that run on several threads at once.
+template <typename Boundary, typename F>
+static inline void for_each_neighbor_concurrently(
+    const Site* grid, SiteIndex i, const NeighborOffsets &offsets, F f) {
+  f(Boundary::enter_concurrently(grid, i - offsets.stride, offsets.wrap_vertical));
+  f(Boundary::enter_concurrently(grid, i + offsets.stride, -offsets.wrap_vertical));
+  f(Boundary::enter_concurrently(grid, i - 1, offsets.wrap_horizontal));
+  f(Boundary::enter_concurrently(grid, i + 1, -offsets.wrap_horizontal));
+}
+
+// Entry policies: where a flow begins.
+struct EntryFromTop {
+  template <typename F>
+  static void for_each_entryway(unsigned int width, unsigned int, F f) {
+    for (auto x{0}; x < width; ++x) {
+      f(x, 0);
+    }
+  }
+};
+struct EntryFromAllSides {
+  template <typename F>
+  static void for_each_entryway(unsigned int width, unsigned int height, F f) {
+    const std::array<unsigned int, 2> ys {0, height - 1};
+    for (auto y : ys) {
+      for (auto x{0}; x < width; ++x) {
+        f(x, y);
+      }
+    }
+    const std::array<unsigned int, 2> xs {0, width - 1};
+    for (auto x : xs) {
+      for (auto y{1}; y < height - 1; ++y) {
+        f(x, y);
+      }
+    }
+  }
+};
 
 namespace measure {
   filler open() {
     // This has to be static so that we can compare fillers, e.g., open() == open() is true.
     const static auto f {
-      [](int x, int y) -> bool {
+      [](int x, int y, RandomStream &) -> bool {
         return true;
       }};
     return f;
@@ -119,28 +292,32 @@ namespace measure {
 
   filler pattern_1() {
     const static auto f {
-      [](int x, int y) -> bool {
+      [](int x, int y, RandomStream &) -> bool {
         return (x + y) % 2;
       }};
     return f;
   }
   filler pattern_2() {
     const static auto f {
-      [](int x, int y) -> bool {
+      [](int x, int y, RandomStream &) -> bool {
         return x % 5 || y % 5;
       }};
     return f;
   }
   filler pattern_3() {
     const static auto f {
-      [](int x, int y) -> bool {
+      [](int x, int y, RandomStream &) -> bool {
         return (x + y) % 10;
       }};
     return f;
   }
 
-  filler bernoulli(double p) {
-    // For me, xorshift32 yields about 30% faster lattice generation than GCC's default std rng.
+  // p is truncated to the given number of binary digits. Lattice::fill() is only a little faster
+  // with fewer (see BernoulliStream).
+  filler bernoulli(double p, unsigned int precision) {
+    // For me, xorshift (see RandomEngine) yields about 30% faster lattice generation than GCC's
+    // default std rng.
+    // Lattice::fill() doesn't call this at all, though: see BernoulliStream.
     // TODO Try doing it on the GPU instead: see e.g. cuRAND, or
     // <http://www0.cs.ucl.ac.uk/staff/ucacbbl/ftp/papers/langdon_2009_CIGPU.pdf>.
 
@@ -148,256 +325,1142 @@ namespace measure {
     //static std::default_random_engine gen(rd());
     //std::bernoulli_distribution dis(p);  // Call dis(gen) for a new random bool.
 
-    // TODO Fix bug: bernoulli(1.0) has a nonzero probability of returning false.
-    const uint32_t barrier = p * std::numeric_limits<uint32_t>::max();
-    const auto gen {[barrier]() { return xorshift32() < barrier; }};
-
-    // TODO Return the *same* lambda if called with the same p twice (do this more elegantly: look
-    // into memoization of functions).
-    return [gen](int x, int y) { return gen(); };
+    // A 64-bit barrier, so that p = 1 always gives true.
+    const bool always {p >= 1.0};
+    uint64_t barrier {p <= 0.0 || always ? 0 : static_cast<uint64_t>(std::ldexp(p, 64))};
+    if (precision < 64) {
+      barrier &= ~uint64_t{0} << (64 - std::max(precision, 1U));
+    }
+    return filler {
+      [barrier, always](int, int, RandomStream &rng) { return always || rng.next() < barrier; },
+      p, precision};
   }
 };
 
-void Lattice::fill(measure::filler f, std::atomic_bool &run) {
+// Opens the first n sites from row where open_bytes says so (or everywhere, if open_bytes is null
+// and all_open is true), and unfloods them. Working on whole site bytes lets this be vectorized.
+static void set_open_sites(Site* row, const uint8_t* open_bytes, bool all_open, std::size_t n) {
+  static const unsigned char open_site_bit {site_field_bit([](Site &s) { s.open = true; })};
+  static const unsigned char flooded_site_bit {site_field_bit([](Site &s) { s.flooded = true; })};
+  // Local copies: the compiler can't tell that writing to the sites doesn't change the statics.
+  const unsigned char open_bit {open_site_bit};
+  const unsigned char keep {static_cast<unsigned char>(~(open_site_bit | flooded_site_bit))};
+  unsigned char* __restrict bytes {reinterpret_cast<unsigned char*>(row)};
+  if (open_bytes == nullptr) {
+    const unsigned char set {all_open ? open_bit : static_cast<unsigned char>(0)};
+    for (std::size_t x {0}; x < n; ++x) {
+      bytes[x] = (bytes[x] & keep) | set;
+    }
+  } else {
+    for (std::size_t x {0}; x < n; ++x) {
+      bytes[x] = (bytes[x] & keep) | (open_bytes[x] * open_bit);
+    }
+  }
+}
+
+// Unfloods (and unfreshens) the first n sites from row, eight sites to a machine word.
+static void unflood_sites(Site* row, std::size_t n) {
+  static const unsigned char flooded_site_bit {site_field_bit([](Site &s) { s.flooded = true; })};
+  static const unsigned char fresh_site_bit {site_field_bit([](Site &s) { s.fresh = true; })};
+  const unsigned char keep {static_cast<unsigned char>(~(flooded_site_bit | fresh_site_bit))};
+  const uint64_t keep_word {keep * 0x0101010101010101ULL};
+  unsigned char* __restrict bytes {reinterpret_cast<unsigned char*>(row)};
+  std::size_t x {0};
+  for (; x + sizeof(uint64_t) <= n; x += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, bytes + x, sizeof(word));
+    word &= keep_word;
+    std::memcpy(bytes + x, &word, sizeof(word));
+  }
+  for (; x < n; ++x) {
+    bytes[x] &= keep;
+  }
+}
+
+// Fills the lattice in blocks of rows, in parallel. Each block draws from its own random stream,
+// so that the result depends only on the seed and the engine, and not on which thread fills which
+// block.
+void Lattice::fill(measure::filler f, uint64_t seed, Progress &progress, RandomEngine engine) {
+  strength_key = ::strength_key(seed);
+  forget_invasion();
   clear_clusters();
   freshly_flooded.clear();
+  flood_times.clear();
   begun_percolation = false;
-  for_each_site(
-    [&](int x, int y) {
-      Site* site {get_site_ptr(x, y)};
-      site->open = f(x, y);
-      site->flooded = false;
-    }, run);
+  progress.start(grid_height);
+  parallel_for_chunks(
+    grid_height, rows_per_block,
+    [&](std::size_t y_begin, std::size_t y_end) {
+      if (f.bernoulli_p() &&
+          BernoulliSkipper::worthwhile(*f.bernoulli_p(), f.bernoulli_precision())) {
+        // Set every site to the majority's state, and then visit only the rest.
+        BernoulliSkipper skipper {
+          *f.bernoulli_p(), seed, y_begin / rows_per_block, f.bernoulli_precision(), engine};
+        const bool majority {skipper.majority()};
+        for (auto y {y_begin}; y < y_end; ++y) {
+          set_open_sites(grid + index_of(0, y), nullptr, majority, grid_width);
+        }
+        const std::size_t block_size {(y_end - y_begin) * grid_width};
+        // A tile is uniform unless a minority site lands in it.
+        std::vector<bool> has_minority(num_tiles_across(), false);
+        for (std::size_t i {skipper.first()}; i < block_size; i = skipper.next(i)) {
+          grid[index_of(i % grid_width, y_begin + i / grid_width)].open = !majority;
+          has_minority[(i % grid_width) / tile_size] = true;
+        }
+        for (unsigned int tile_x {0}; tile_x < num_tiles_across(); ++tile_x) {
+          tile_occupancies[y_begin / tile_size * num_tiles_across() + tile_x] =
+            has_minority[tile_x] ? TileOccupancy::mixed
+            : majority ? TileOccupancy::open : TileOccupancy::closed;
+        }
+      } else if (f.bernoulli_p()) {
+        // The whole block at once: the bits come in batches of 512.
+        BernoulliStream bits {
+          *f.bernoulli_p(), seed, y_begin / rows_per_block, f.bernoulli_precision(), engine};
+        std::vector<uint8_t> block_bits((y_end - y_begin) * grid_width);
+        bits.generate(block_bits.data(), block_bits.size());
+        for (auto y {y_begin}; y < y_end; ++y) {
+          set_open_sites(grid + index_of(0, y), &block_bits[(y - y_begin) * grid_width], false,
+                         grid_width);
+        }
+        summarize_tiles(y_begin / tile_size);
+      } else {
+        RandomStream rng {seed, y_begin / rows_per_block, engine};
+        for (auto y {y_begin}; y < y_end; ++y) {
+          Site* row {grid + index_of(0, y)};
+          for (int x {0}; x < static_cast<int>(grid_width); ++x) {
+            row[x].open = f(x, y, rng);
+            row[x].flooded = false;
+          }
+        }
+        summarize_tiles(y_begin / tile_size);
+      }
+      progress.advance(y_end - y_begin);
+    }, progress.run_flag());
+  update_border();
+  if (progress.running()) {
+    maybe_flooded = false;  // Every site was unflooded.
+  }
+}
+
+// Works out the occupancy of each tile in a row of tiles, from its sites. Usually a mixed tile is
+// found out within its first row.
+void Lattice::summarize_tiles(unsigned int tile_y) {
+  const unsigned int y_begin {tile_y * tile_size};
+  const unsigned int y_end {std::min(y_begin + tile_size, grid_height)};
+  for (unsigned int tile_x {0}; tile_x < num_tiles_across(); ++tile_x) {
+    const unsigned int x_begin {tile_x * tile_size};
+    const unsigned int x_end {std::min(x_begin + tile_size, grid_width)};
+    bool any_open {false};
+    bool any_closed {false};
+    for (unsigned int y {y_begin}; y < y_end && !(any_open && any_closed); ++y) {
+      const Site* row {grid + index_of(0, y)};
+      for (unsigned int x {x_begin}; x < x_end; ++x) {
+        any_open |= row[x].open;
+        any_closed |= !row[x].open;
+      }
+    }
+    tile_occupancies[tile_y * num_tiles_across() + tile_x] =
+      any_open && any_closed ? TileOccupancy::mixed
+      : any_open ? TileOccupancy::open : TileOccupancy::closed;
+  }
+}
+
+TileOccupancy Lattice::tile_occupancy(unsigned int tile_x, unsigned int tile_y) const {
+  return tile_occupancies[tile_y * num_tiles_across() + tile_x];
+}
+
+unsigned int Lattice::num_tiles_across() const {
+  return (grid_width + tile_size - 1) / tile_size;
 }
 
-// Return true if anything new got flooded.
-bool Lattice::flood_entryways() {
+unsigned int Lattice::num_tiles_down() const {
+  return (grid_height + tile_size - 1) / tile_size;
+}
+
+// Return true if anything new got flooded. An invasion has only one entryway: the weakest. Only an
+// invasion with trapping takes long (and checks run): it must be worked out in full first.
+bool Lattice::flood_entryways(std::atomic_bool &run) {
+  if (flow_model == FlowModel::invasion) {
+    if (begun_percolation) {
+      return false;
+    }
+    Progress progress {run};
+    return begin_invasion(progress);
+  }
+  switch (flow_direction) {
+  case FlowDirection::top:
+    return flood_entryways_<EntryFromTop>();
+  case FlowDirection::all_sides:
+    return flood_entryways_<EntryFromAllSides>();
+  default:
+    assert(false);
+    return false;
+  }
+}
+
+template <typename Entry>
+bool Lattice::flood_entryways_() {
+  if (!begun_percolation) {
+    flow_step = 0;
+    // Keep the map if it's still valid, i.e., if we've merely rewound to the start of the flow.
+    if (!record_flood_times) {
+      flood_times.clear();
+    } else if (flood_times.empty()) {
+      flood_times.assign(grid_size(), 0);
+      recorded_flow_steps = 0;
+    }
+  }
+  // Entryways opened midway through a flow join the current wave.
+  const unsigned int entry_step {std::max(flow_step, 1U)};
   auto flooded_something_new {false};
   auto flood_entryway {
-    [this, &flooded_something_new](int x, int y) {
+    [&](int x, int y) {
       Site* site {get_site_ptr(x, y)};
       if (site->open) {
         if (!site->flooded) {
           site->flooded = true;
           site->fresh = true;
-          freshly_flooded.emplace_back(x, y);
+          freshly_flooded.add(index_of(x, y));
+          if (!flood_times.empty()) {
+            flood_times[index_of(x, y)] = entry_step;
+          }
           flooded_something_new = true;
         }
       }
     }};
   begun_percolation = true;
+  maybe_flooded = true;
+  Entry::for_each_entryway(grid_width, grid_height, flood_entryway);
 
-  switch (flow_direction) {
-  case FlowDirection::top:
-    for (auto x{0}; x < grid_width; ++x) {
-      flood_entryway(x, 0);
-    }
-    break;
-  case FlowDirection::all_sides: {
-    const std::array<unsigned int, 2> ys {0, grid_height - 1};
-    for (auto y : ys) {
-      for (auto x{0}; x < grid_width; ++x) {
-        flood_entryway(x, y);
-      }
+  if (flooded_something_new) {
+    if (flow_step == 0) {
+      flow_step = 1;
+    } else {
+      // The recorded flow (if any) went differently from here on.
+      forget_flood_times_after(flow_step);
     }
-    const std::array<unsigned int, 2> xs {0, grid_width - 1};
-    for (auto x : xs) {
-      for (auto y{1}; y < grid_height - 1; ++y) {
-        flood_entryway(x, y);
-      }
-    }
-    break; }
-  default:
-    assert(false);
-    break;
+    recorded_flow_steps = std::max(recorded_flow_steps, flow_step);
   }
-
   return flooded_something_new;
 }
 
 // Returns true if anything new gets flooded.
 bool Lattice::flow_one_step(std::atomic_bool &run) {
-  if (torus) {
-    return flow_one_step_torus(run);
+  if (flow_model == FlowModel::invasion) {
+    Progress progress {run};
+    return begun_percolation ? invade_one_step(progress) : begin_invasion(progress);
   }
   if (!begun_percolation) {
-    return flood_entryways();
-  }
-  static std::vector<Coords> currently_flooding;
-  currently_flooding.clear();
-  for (auto p : freshly_flooded) {
-    if (!run) { break; }
-    get_site_ptr(p.x, p.y)->fresh = false;
-    if (p.y > 0) {
-      auto site {get_site_ptr(p.x, p.y - 1)};
+    return flood_entryways(run);
+  }
+  return torus ? flow_one_step_<TorusEdges>(run) : flow_one_step_<OpenEdges>(run);
+}
+
+template <typename Boundary>
+bool Lattice::flow_one_step_(std::atomic_bool &run) {
+  // Below this, spreading the work among threads costs more than it saves.
+  constexpr std::size_t min_parallel_frontier {1 << 16};
+  static const bool multicore {std::thread::hardware_concurrency() > 1};
+  if (parallel_flow.value_or(multicore && freshly_flooded.size() >= min_parallel_frontier)) {
+    return flow_one_step_parallel_<Boundary>(run);
+  }
+  begin_flow_step();
+  const NeighborOffsets offsets {grid_width, grid_height};
+  auto visit {
+    [&](SiteIndex i) {
+      Site* site {grid + i};
       if (site->open && !site->flooded) {
         site->flooded = true;
         site->fresh = true;
-        currently_flooding.emplace_back(p.x, p.y-1);
+        next_frontier.add(i);
       }
+    }};
+  freshly_flooded.for_each(
+    [&](SiteIndex i) {
+      grid[i].fresh = false;
+      for_each_neighbor<Boundary>(grid, i, offsets, visit);
+    }, run);
+  return finish_flow_step();
+}
+
+// Same as flow_one_step_(), but the frontier is split among threads. Sites are claimed
+// atomically, so each is flooded exactly once. A sparse new frontier is collected by each thread
+// in its own part, and the parts are then joined in order; a dense one is a bitmap that all
+// threads write into atomically.
+template <typename Boundary>
+bool Lattice::flow_one_step_parallel_(std::atomic_bool &run) {
+  begin_flow_step();
+  const NeighborOffsets offsets {grid_width, grid_height};
+  const std::size_t chunk_size {freshly_flooded.is_dense() ? 1U << 8 : 1U << 12};
+  const std::size_t num_chunks {(freshly_flooded.num_slots() + chunk_size - 1) / chunk_size};
+  std::vector<std::vector<SiteIndex>> parts(next_frontier.is_dense() ? 0 : num_chunks);
+  parallel_for_chunks(
+    freshly_flooded.num_slots(), chunk_size,
+    [&](std::size_t begin, std::size_t end) {
+      std::vector<SiteIndex>* part {nullptr};
+      if (!next_frontier.is_dense()) {
+        part = &parts[begin / chunk_size];
+        part->reserve(end - begin);
+      }
+      auto visit {
+        [&](SiteIndex i) {
+          if (claim_site_atomically(grid + i)) {
+            if (part) {
+              part->push_back(i);
+            } else {
+              next_frontier.add_atomically(i);
+            }
+          }
+        }};
+      freshly_flooded.for_each_in_slots(
+        begin, end,
+        [&](SiteIndex i) {
+          unfresh_site_atomically(grid + i);
+          for_each_neighbor_concurrently<Boundary>(grid, i, offsets, visit);
+        });
+    }, run);
+
+  if (!next_frontier.is_dense()) {
+    // Join the parts. Each one is copied into its own place, so no locking is needed.
+    std::vector<std::size_t> part_offsets(parts.size() + 1, 0);
+    for (std::size_t i {0}; i < parts.size(); ++i) {
+      part_offsets[i + 1] = part_offsets[i] + parts[i].size();
     }
-    if (p.y < grid_height - 1) {
-      auto site {get_site_ptr(p.x, p.y + 1)};
-      if (site->open && !site->flooded) {
-        site->flooded = true;
-        site->fresh = true;
-        currently_flooding.emplace_back(p.x, p.y+1);
+    std::vector<SiteIndex> joined(part_offsets.back());
+    const std::atomic_bool join_all {true};  // Even if aborted, the frontier must be complete.
+    parallel_for_chunks(
+      parts.size(), 1,
+      [&](std::size_t i, std::size_t) {
+        std::copy(parts[i].begin(), parts[i].end(), joined.begin() + part_offsets[i]);
+      }, join_all);
+    next_frontier.assign(std::move(joined));
+  }
+  return finish_flow_step();
+}
+
+// Prepares next_frontier to receive the sites flooded in this step. Assume the new wave will be
+// about as big as the current one.
+void Lattice::begin_flow_step() {
+  next_frontier.reset(
+    grid_size(), Frontier::should_be_dense(freshly_flooded.size(), grid_size()));
+}
+
+// Makes next_frontier the current frontier and records its flood times. Returns true if anything
+// new got flooded.
+bool Lattice::finish_flow_step() {
+  next_frontier.settle();
+  std::swap(freshly_flooded, next_frontier);
+  if (freshly_flooded.empty()) {
+    return false;
+  }
+  ++flow_step;
+  if (!flood_times.empty()) {
+    freshly_flooded.for_each([&](SiteIndex i) { flood_times[i] = flow_step; });
+    recorded_flow_steps = std::max(recorded_flow_steps, flow_step);
+  }
+  return true;
+}
+
+// The progress is measured in sites flooded. Usually not every site gets flooded, so the progress
+// jumps at the end.
+void Lattice::flow_fully(Progress &progress) {
+  if (flow_model == FlowModel::invasion) {
+    invade_fully(progress);
+    return;
+  }
+  progress.start(static_cast<std::size_t>(grid_width) * grid_height);
+  if (!begun_percolation) {
+    flood_entryways(progress.run_flag());
+  }
+  progress.advance(freshly_flooded.size());
+  if (torus) {
+    flow_until_done<TorusEdges>(false, progress);
+  } else {
+    flow_until_done<OpenEdges>(false, progress);
+  }
+  if (progress.running()) {
+    progress.finish();
+  }
+}
+
+void Lattice::forget_flood_times_after(unsigned int step) {
+  if (flood_times.empty() || recorded_flow_steps <= step) {
+    return;
+  }
+  for (auto &t : flood_times) {
+    if (t > step) {
+      t = 0;
+    }
+  }
+  recorded_flow_steps = step;
+}
+
+// Flood times are recorded only while flowing (not while finding clusters), and only for flows
+// started after recording is turned on.
+void Lattice::set_record_flood_times(bool record) {
+  record_flood_times = record;
+}
+
+// The number of steps the current flow has taken, counting the flooding of the entryways.
+unsigned int Lattice::num_flow_steps() const {
+  return flow_step;
+}
+
+// The number of steps that seek_flow() can jump to. Zero unless flood times are being recorded.
+unsigned int Lattice::num_recorded_flow_steps() const {
+  return flood_times.empty() ? 0 : recorded_flow_steps;
+}
+
+// Puts the lattice in the state it was in (or will be in) after the given number of flow steps,
+// in a single pass over the flood-time map. Returns false if that step hasn't been recorded, or if
+// aborted. An aborted seek can't stop where it is, with some rows at the new step and the rest at
+// the old one, so it goes back to the start of the flow instead, as seek_flow(0) would: nothing is
+// flooded, and the recording is kept, so the seek can be asked for again.
+bool Lattice::seek_flow(unsigned int step, std::atomic_bool &run) {
+  if (flood_times.empty() || step > recorded_flow_steps) {
+    return false;
+  }
+  // Each block of rows gathers its own part of the new frontier, in order.
+  std::vector<std::vector<SiteIndex>> frontier_parts(
+    (grid_height + rows_per_block - 1) / rows_per_block);
+  parallel_for_chunks(
+    grid_height, rows_per_block,
+    [&](std::size_t y_begin, std::size_t y_end) {
+      auto &part {frontier_parts[y_begin / rows_per_block]};
+      for (auto y {y_begin}; y < y_end; ++y) {
+        for (auto x {0}; x < grid_width; ++x) {
+          const SiteIndex i {index_of(x, y)};
+          const uint32_t t {flood_times[i]};
+          Site* site {grid + i};
+          site->flooded = t != 0 && t <= step;
+          site->fresh = t != 0 && t == step;
+          if (site->fresh) {
+            part.push_back(i);
+          }
+        }
       }
+    }, run);
+  if (!run) {
+    maybe_flooded = true;  // Some rows may be flooded, whatever the old step was.
+    unflood_all();
+    freshly_flooded.clear();
+    flow_step = 0;
+    begun_percolation = false;
+    return false;
+  }
+
+  std::vector<SiteIndex> frontier;
+  for (const auto &part : frontier_parts) {
+    frontier.insert(std::end(frontier), std::begin(part), std::end(part));
+  }
+  freshly_flooded.reset(grid_size(), false);
+  freshly_flooded.assign(std::move(frontier));
+  freshly_flooded.settle();
+  flow_step = step;
+  begun_percolation = step > 0;
+  maybe_flooded = maybe_flooded || step > 0;
+  return true;
+}
+
+// Returns the number of sites flooded at each step of the recorded flow: element k is the number
+// of sites flooded at step k, and element 0 is the number of sites never flooded.
+std::vector<unsigned int> Lattice::flood_time_histogram() const {
+  std::vector<unsigned int> histogram;
+  if (flood_times.empty()) {
+    return histogram;
+  }
+  histogram.resize(recorded_flow_steps + 1, 0);
+  for (auto y {0}; y < grid_height; ++y) {
+    for (auto x {0}; x < grid_width; ++x) {
+      ++histogram[flood_times[index_of(x, y)]];
     }
-    if (p.x > 0) {
-      auto site {get_site_ptr(p.x - 1, p.y)};
-      if (site->open && !site->flooded) {
-        site->flooded = true;
-        site->fresh = true;
-        currently_flooding.emplace_back(p.x-1, p.y);
+  }
+  return histogram;
+}
+
+// Returns whether an open path joins the top row to the bottom row or, on a torus, whether one
+// wraps around vertically. Only which sites are open matters: the flow is neither used nor
+// changed. The search stops as soon as the answer is known, so it's usually much cheaper than
+// flow_fully(). If bidirectional, it grows from the top and the bottom at once, and gives up as
+// soon as either side is cut off; this is ignored on a torus, which has no top or bottom. Returns
+// nullopt if aborted (or out of time). How far the search will go isn't known in advance, so the
+// progress only counts the sites visited.
+std::optional<SpanningResult> Lattice::percolates(bool bidirectional, Progress &progress) const {
+  progress.start(0);
+  if (torus) {
+    return wraps_vertically(progress);
+  }
+  return bidirectional ? spans_from_top_and_bottom(progress) : spans_from_top(progress);
+}
+
+// Flows a Bernoulli(p) torus from the top twice, a step at a time: once expanding every frontier
+// on this thread, and once expanding every frontier in parallel, however small, with the ghosts
+// being read while other threads flood their neighbors. Returns whether every step left the two
+// grids the same, or nothing if aborted. Otherwise, the parallel kernel is only reached by
+// frontiers of min_parallel_frontier sites, on machines with more than one core.
+std::optional<bool> Lattice::check_parallel_flow(unsigned int width, unsigned int height, double p,
+                                                 uint64_t seed, std::atomic_bool &run) {
+  Progress progress {run};
+  Lattice serial {width, height};
+  serial.set_torus(true);
+  serial.set_flow_direction(FlowDirection::top);
+  serial.fill(measure::bernoulli(p), seed, progress);
+  if (!run) {
+    return std::nullopt;
+  }
+  Lattice parallel {serial, progress};
+  if (!run) {
+    return std::nullopt;
+  }
+  serial.parallel_flow = false;
+  parallel.parallel_flow = true;
+  for (;;) {
+    const bool serial_flowed {serial.flow_one_step(run)};
+    const bool parallel_flowed {parallel.flow_one_step(run)};
+    if (!run) {
+      return std::nullopt;
+    }
+    if (serial_flowed != parallel_flowed ||
+        std::memcmp(serial.grid, parallel.grid, serial.grid_size()) != 0) {
+      return false;
+    }
+    if (!serial_flowed) {
+      return serial.num_flow_steps() == parallel.num_flow_steps();
+    }
+  }
+}
+
+// How many sites the spanning searches visit between checks of the progress (which is when a time
+// budget runs out, too).
+constexpr std::size_t sites_per_run_check {1 << 12};
+
+// Advances the progress of a spanning search by a batch of sites, every sites_per_run_check sites.
+// Returns false if the search must stop.
+static bool keep_searching(std::size_t num_visited, Progress &progress) {
+  if (num_visited % sites_per_run_check != 0) {
+    return true;
+  }
+  progress.advance(sites_per_run_check);
+  return progress.running();
+}
+
+// Depth-first search from the top row, heading downward first.
+std::optional<SpanningResult> Lattice::spans_from_top(Progress &progress) const {
+  const SiteIndex stride {grid_stride()};
+  const SiteIndex bottom_row {index_of(0, grid_height - 1)};
+  std::vector<unsigned char> seen(grid_size(), false);
+  std::vector<SiteIndex> stack;
+  std::size_t touched {0};
+  auto visit {
+    [&](SiteIndex i) {
+      if (grid[i].open && !seen[i]) {  // The border is closed.
+        seen[i] = true;
+        ++touched;
+        stack.push_back(i);
       }
+    }};
+  for (auto x {0}; x < grid_width; ++x) {
+    visit(index_of(x, 0));
+  }
+  for (std::size_t num_visited {1}; !stack.empty(); ++num_visited) {
+    if (!keep_searching(num_visited, progress)) {
+      return std::nullopt;
     }
-    if (p.x < grid_width - 1) {
-      auto site {get_site_ptr(p.x + 1, p.y)};
-      if (site->open && !site->flooded) {
-        site->flooded = true;
-        site->fresh = true;
-        currently_flooding.emplace_back(p.x+1, p.y);
+    const SiteIndex i {stack.back()};
+    stack.pop_back();
+    if (i >= bottom_row) {
+      return SpanningResult {true, touched};
+    }
+    // The last one pushed is the first one explored.
+    visit(i - stride);
+    visit(i - 1);
+    visit(i + 1);
+    visit(i + stride);
+  }
+  return SpanningResult {false, touched};
+}
+
+// Depth-first searches from the top row heading down and from the bottom row heading up, taking
+// turns, until the two meet or one of them runs out of sites.
+std::optional<SpanningResult> Lattice::spans_from_top_and_bottom(Progress &progress) const {
+  const SiteIndex stride {grid_stride()};
+  constexpr unsigned char top {1};
+  constexpr unsigned char bottom {2};
+  std::vector<unsigned char> side_of(grid_size(), 0);
+  std::array<std::vector<SiteIndex>, 2> stacks;
+  std::size_t touched {0};
+  // Returns true if the site was already reached from the other side.
+  auto visit {
+    [&](SiteIndex i, unsigned char side) {
+      if (!grid[i].open) {  // The border is closed.
+        return false;
       }
+      if (side_of[i] == 0) {
+        side_of[i] = side;
+        ++touched;
+        stacks[side - 1].push_back(i);
+        return false;
+      }
+      return side_of[i] != side;
+    }};
+  for (auto x {0}; x < grid_width; ++x) {
+    visit(index_of(x, 0), top);
+  }
+  for (auto x {0}; x < grid_width; ++x) {
+    if (visit(index_of(x, grid_height - 1), bottom)) {
+      return SpanningResult {true, touched};  // The lattice is one row high.
     }
   }
-  freshly_flooded.swap(currently_flooding);
-  return not freshly_flooded.empty();
+  for (std::size_t num_visited {1}; !stacks[0].empty() && !stacks[1].empty(); ++num_visited) {
+    if (!keep_searching(num_visited, progress)) {
+      return std::nullopt;
+    }
+    const unsigned char side {num_visited % 2 ? top : bottom};
+    auto &stack {stacks[side - 1]};
+    const SiteIndex i {stack.back()};
+    stack.pop_back();
+    // The last one pushed, toward the other side, is the first one explored.
+    const SiteIndex away {side == top ? i - stride : i + stride};
+    const SiteIndex toward {side == top ? i + stride : i - stride};
+    if (visit(away, side) || visit(i - 1, side) || visit(i + 1, side) || visit(toward, side)) {
+      return SpanningResult {true, touched};
+    }
+  }
+  return SpanningResult {false, touched};
 }
 
-inline bool Lattice::flow_one_step_torus(std::atomic_bool &run) {
-  if (!begun_percolation) {
-    return flood_entryways();
-  }
-  static std::vector<Coords> currently_flooding;
-  currently_flooding.clear();
-  for (auto p : freshly_flooded) {
-    if (!run) { break; }
-    get_site_ptr(p.x, p.y)->fresh = false;
-    auto nx {p.x};
-    auto ny {p.y - 1};
-    if (ny < 0) { ny += grid_height; };
-    Site* site;
-    site = get_site_ptr(nx, ny);
-    if (site->open && !site->flooded) {
-      site->flooded = true;
-      site->fresh = true;
-      currently_flooding.emplace_back(nx, ny);
-    }
-    ny += 2;
-    if (ny > grid_height - 1 ) { ny -= grid_height; }
-    site = get_site_ptr(nx, ny);
-    if (site->open && !site->flooded) {
-      site->flooded = true;
-      site->fresh = true;
-      currently_flooding.emplace_back(nx, ny);
-    }
-    nx -= 1;
-    if (nx < 0) { nx += grid_width; }
-    ny = p.y;
-    site = get_site_ptr(nx, ny);
-    if (site->open && !site->flooded) {
-      site->flooded = true;
-      site->fresh = true;
-      currently_flooding.emplace_back(nx, ny);
-    }
-    nx += 2;
-    if (nx > grid_width - 1) { nx -= grid_width; }
-    site = get_site_ptr(nx, ny);
-    if (site->open && !site->flooded) {
-      site->flooded = true;
-      site->fresh = true;
-      currently_flooding.emplace_back(nx, ny);
-    }
-  }
-  freshly_flooded.swap(currently_flooding);
-  return not freshly_flooded.empty();
-}
-
-void Lattice::flow_fully(std::atomic_bool &run) {
-  flow_fully_(false, run);
-}
-
-void Lattice::flow_fully_(bool track_cluster, std::atomic_bool &run) {
-  if (!begun_percolation) {
-    flood_entryways();
+// A cluster wraps around the torus vertically if and only if some site in it can be reached by
+// two paths that cross the top edge a different number of times. So each cluster that touches
+// the top row is searched, recording for every site the net number of times the path to it went
+// down across the edge.
+std::optional<SpanningResult> Lattice::wraps_vertically(Progress &progress) const {
+  const NeighborOffsets offsets {grid_width, grid_height};
+  constexpr int32_t unseen {std::numeric_limits<int32_t>::min()};
+  std::vector<int32_t> windings(grid_size(), unseen);
+  std::vector<SiteIndex> stack;
+  std::size_t touched {0};
+  // Returns true if the site was already reached with a different winding.
+  auto visit {
+    [&](SiteIndex i, int32_t winding) {
+      if (!grid[i].open) {
+        return false;
+      }
+      if (windings[i] == unseen) {
+        windings[i] = winding;
+        ++touched;
+        stack.push_back(i);
+        return false;
+      }
+      return windings[i] != winding;
+    }};
+  std::size_t num_visited {0};
+  for (auto x {0}; x < grid_width; ++x) {
+    visit(index_of(x, 0), 0);
+    while (!stack.empty()) {
+      if (!keep_searching(++num_visited, progress)) {
+        return std::nullopt;
+      }
+      const SiteIndex i {stack.back()};
+      stack.pop_back();
+      const int32_t winding {windings[i]};
+      const SiteIndex up {i - offsets.stride};
+      const SiteIndex down {i + offsets.stride};
+      if (visit(TorusEdges::enter(grid, up, offsets.wrap_vertical), winding - grid[up].ghost) ||
+          visit(TorusEdges::enter(grid, down, -offsets.wrap_vertical),
+                winding + grid[down].ghost) ||
+          visit(TorusEdges::enter(grid, i - 1, offsets.wrap_horizontal), winding) ||
+          visit(TorusEdges::enter(grid, i + 1, -offsets.wrap_horizontal), winding)) {
+        return SpanningResult {true, touched};
+      }
+    }
   }
+  return SpanningResult {false, touched};
+}
+
+// Flows until nothing new gets flooded, advancing the progress by the number of sites flooded
+// (not counting those that were fresh to begin with). If track_cluster is true, the flooded sites
+// are appended to cluster_sites.
+template <typename Boundary>
+void Lattice::flow_until_done(bool track_cluster, Progress &progress) {
+  std::atomic_bool &run {progress.run_flag()};
   if (track_cluster) {
-    do {
-      // Append the newly flooded sites to the current cluster.
-      current_cluster.insert(
-        std::end(current_cluster),
-        std::begin(freshly_flooded),
-        std::end(freshly_flooded));
-    } while (run && flow_one_step(run));
+    freshly_flooded.for_each([&](SiteIndex i) { cluster_sites.push_back(i); });
+  }
+  while (run && flow_one_step_<Boundary>(run)) {
+    progress.advance(freshly_flooded.size());
+    if (track_cluster) {
+      freshly_flooded.for_each([&](SiteIndex i) { cluster_sites.push_back(i); });
+    }
+  }
+}
+
+void Lattice::find_clusters(Progress &progress) {
+  if (torus) {
+    find_clusters_<TorusEdges>(progress);
   } else {
-    while (run && flow_one_step(run)) {};
+    find_clusters_<OpenEdges>(progress);
+  }
+}
+
+bool Lattice::extend_invasion(std::size_t num_steps, Progress &progress) {
+  if (invasion_complete) {
+    return true;
+  }
+  const bool from_top {flow_direction == FlowDirection::top};
+  if (torus) {
+    return from_top ? extend_invasion_<TorusEdges, EntryFromTop>(num_steps, progress)
+                    : extend_invasion_<TorusEdges, EntryFromAllSides>(num_steps, progress);
+  }
+  return from_top ? extend_invasion_<OpenEdges, EntryFromTop>(num_steps, progress)
+                  : extend_invasion_<OpenEdges, EntryFromAllSides>(num_steps, progress);
+}
+
+// Works out the invasion until it has num_steps sites, or ends, without flooding anything. The
+// perimeter is kept in a bucket queue over the (quantized) strengths, which each site enters at
+// most once. With trapping, it's always worked out to the end. The progress is measured in sites
+// taken. Returns false if aborted (it can be carried on later).
+template <typename Boundary, typename Entry>
+bool Lattice::extend_invasion_(std::size_t num_steps, Progress &progress) {
+  const NeighborOffsets offsets {grid_width, grid_height};
+  const bool ends_at_bottom {!torus && flow_direction == FlowDirection::top};
+  const bool traps {trapping && ends_at_bottom};
+  if (!traps && invasion.size() >= num_steps) {
+    return true;
+  }
+  if (!progress.running()) {
+    return false;
+  }
+  const bool starting {!invader_perimeter};
+  if (starting) {
+    invader_perimeter = std::make_unique<StrengthQueue>(grid_size());
+  }
+  StrengthQueue &perimeter {*invader_perimeter};
+  auto enqueue {
+    [&](SiteIndex i) {
+      if (grid[i].open && !perimeter.was_pushed(i)) {
+        perimeter.push(site_strength(strength_key, i), i);
+      }
+    }};
+  if (starting) {
+    Entry::for_each_entryway(grid_width, grid_height,
+                             [&](int x, int y) { enqueue(index_of(x, y)); });
+  }
+
+  const SiteIndex bottom_row {index_of(0, grid_height - 1)};
+  constexpr std::size_t sites_per_check {1 << 16};
+  std::size_t num_taken {0};
+  while (traps || invasion.size() < num_steps) {
+    if (perimeter.empty()) {
+      invasion_complete = true;
+      break;
+    }
+    const SiteIndex i {perimeter.pop()};
+    invasion.push_back(i);
+    if (ends_at_bottom && i >= bottom_row) {
+      invasion_complete = true;  // Broken through
+      break;
+    }
+    for_each_neighbor<Boundary>(grid, i, offsets, enqueue);
+    if (++num_taken % sites_per_check == 0) {
+      if (!progress.running()) {
+        return false;
+      }
+      progress.advance(sites_per_check);
+    }
+  }
+  if (invasion_complete) {
+    invader_perimeter.reset();
+    if (traps) {
+      remove_trapped_sites(invasion);
+    }
+  }
+  return true;
+}
+
+// After anything that changes what the invasion would be.
+void Lattice::forget_invasion() {
+  invasion.clear();
+  invasion_complete = false;
+  invader_perimeter.reset();
+}
+
+// A site is trapped if, when the invader took it, the sites not yet taken around it had no way out
+// through the bottom row. This is found after the fact, going backwards through the invasion and
+// handing each site back to the defender, whose regions are kept as disjoint sets: each site joins
+// the regions of its neighbors, and was trapped if the region it ends up in has no way out. Only
+// for an invasion from the top of a rectangle. The invasion with trapping is the same as without,
+// except that it skips the trapped sites (which lead only to other trapped sites).
+void Lattice::remove_trapped_sites(std::vector<SiteIndex> &order) const {
+  const NeighborOffsets offsets {grid_width, grid_height};
+  const SiteIndex bottom_row {index_of(0, grid_height - 1)};
+  DisjointSets defender {grid_size()};
+  auto give_back {
+    [&](SiteIndex i) {
+      defender.add(i, i >= bottom_row);
+      for_each_neighbor<OpenEdges>(
+        grid, i, offsets,
+        [&](SiteIndex neighbor) {
+          if (defender.contains(neighbor)) {
+            defender.unite(i, neighbor);
+          }
+        });
+    }};
+  std::vector<bool> taken(grid_size(), false);
+  for (const SiteIndex i : order) {
+    taken[i] = true;
+  }
+  for (unsigned int y {0}; y < grid_height; ++y) {
+    for (unsigned int x {0}; x < grid_width; ++x) {
+      const SiteIndex i {index_of(x, y)};
+      if (grid[i].open && !taken[i]) {
+        give_back(i);
+      }
+    }
+  }
+  std::vector<bool> trapped(order.size(), false);
+  for (std::size_t k {order.size()}; k-- > 0;) {
+    give_back(order[k]);
+    trapped[k] = !defender.escapes(order[k]);
+  }
+  std::size_t num_kept {0};
+  for (std::size_t k {0}; k < order.size(); ++k) {
+    if (!trapped[k]) {
+      order[num_kept++] = order[k];
+    }
+  }
+  order.resize(num_kept);
+}
+
+// Takes the first site of the invasion. Returns false if there's none, or if aborted.
+bool Lattice::begin_invasion(Progress &progress) {
+  if (!extend_invasion(1, progress)) {
+    return false;
+  }
+  flow_step = 0;
+  // Keep the map if it's still valid, i.e., if we've merely rewound to the start of the invasion.
+  if (!record_flood_times) {
+    flood_times.clear();
+  } else if (flood_times.empty()) {
+    flood_times.assign(grid_size(), 0);
+    recorded_flow_steps = 0;
+  }
+  begun_percolation = true;
+  maybe_flooded = true;
+  freshly_flooded.clear();
+  return invade_one_step(progress);
+}
+
+// Takes the next site of the invasion. It's the only fresh site. Returns false if the invasion is
+// over, or if aborted.
+bool Lattice::invade_one_step(Progress &progress) {
+  freshly_flooded.for_each([&](SiteIndex i) { grid[i].fresh = false; });
+  freshly_flooded.clear();
+  if (!extend_invasion(flow_step + 1, progress) || flow_step >= invasion.size()) {
+    return false;
+  }
+  const SiteIndex i {invasion[flow_step]};
+  grid[i].flooded = true;
+  grid[i].fresh = true;
+  freshly_flooded.add(i);
+  ++flow_step;
+  if (!flood_times.empty()) {
+    flood_times[i] = flow_step;
+    recorded_flow_steps = std::max(recorded_flow_steps, flow_step);
+  }
+  return true;
+}
+
+// Takes the rest of the invasion at once, leaving no fresh sites. The progress is measured in
+// sites, as for an ordinary flow; most of the work is in working out the invasion.
+void Lattice::invade_fully(Progress &progress) {
+  progress.start(static_cast<std::size_t>(grid_width) * grid_height);
+  if (!begun_percolation && !begin_invasion(progress)) {
+    return;
+  }
+  if (!extend_invasion(SIZE_MAX, progress)) {
+    return;
+  }
+  freshly_flooded.for_each([&](SiteIndex i) { grid[i].fresh = false; });
+  freshly_flooded.clear();
+  const bool recording {!flood_times.empty()};
+  for (; flow_step < invasion.size(); ++flow_step) {
+    const SiteIndex i {invasion[flow_step]};
+    grid[i].flooded = true;
+    if (recording) {
+      flood_times[i] = flow_step + 1;
+    }
+  }
+  if (recording) {
+    recorded_flow_steps = std::max(recorded_flow_steps, flow_step);
+  }
+  if (progress.running()) {
+    progress.finish();
   }
 }
 
-void Lattice::find_clusters(std::atomic_bool &run) {
+// The progress is measured in sites labeled (or found to be closed).
+//
+// Closed tiles are skipped. If most tiles are open, clusters are flooded by
+// flood_cluster_by_tiles() instead of by flowing, so that open tiles can be taken whole.
+template <typename Boundary>
+void Lattice::find_clusters_(Progress &progress) {
   reset_percolation();
   clear_clusters();
   begun_percolation = true;
-  auto begin_flooding_at {
-    [&](int x, int y) -> bool {
-      freshly_flooded.clear();
-      Site* site {get_site_ptr(x, y)};
-      if (site->open && !site->flooded) {
+  maybe_flooded = true;
+  progress.start(static_cast<std::size_t>(grid_width) * grid_height);
+  // The search by tiles costs more per site than a flow does, so it only pays if it can take most
+  // of the lattice a tile at a time.
+  const bool by_tiles {
+    2 * std::count(tile_occupancies.begin(), tile_occupancies.end(), TileOccupancy::open) >
+    static_cast<std::ptrdiff_t>(tile_occupancies.size())};
+  for_each_row_mutable(
+    [&](int y, Site* row) {
+      // The first site of each cluster, as well as each closed site, is counted here. The rest are
+      // counted as they're flooded.
+      std::size_t row_work {0};
+      for (unsigned int tile_x {0}; tile_x < num_tiles_across(); ++tile_x) {
+        const int x_begin {static_cast<int>(tile_x * tile_size)};
+        const int x_end {static_cast<int>(std::min((tile_x + 1) * tile_size, grid_width))};
+        const TileOccupancy occupancy {tile_occupancy(tile_x, y / tile_size)};
+        if (occupancy == TileOccupancy::closed) {
+          row_work += x_end - x_begin;
+          continue;
+        }
+        if (occupancy == TileOccupancy::open && by_tiles && row[x_begin].flooded) {
+          continue;  // Taken whole, with some cluster.
+        }
+        for (int x {x_begin}; x < x_end; ++x) {
+          Site* site {row + x};
+          if (site->open && !site->flooded) {
+            const std::size_t begin {cluster_sites.size()};
+            if (by_tiles) {
+              flood_cluster_by_tiles<Boundary>(index_of(x, y), progress);
+            } else {
+              site->flooded = true;
+              site->fresh = true;
+              freshly_flooded.clear();
+              freshly_flooded.add(index_of(x, y));
+              flow_until_done<Boundary>(true, progress);
+            }
+            add_cluster(begin);
+            ++row_work;
+          } else if (!site->open) {
+            ++row_work;
+          }
+        }
+      }
+      progress.advance(row_work);
+    }, progress.run_flag());
+  freshly_flooded.clear();
+  flow_step = 0;
+}
+
+// Floods the cluster of the given open, unflooded site, appending its sites to cluster_sites. It's
+// a depth-first search, in which an open tile is taken whole as soon as the cluster reaches it:
+// all its sites join at once, and only its edges are searched further.
+template <typename Boundary>
+void Lattice::flood_cluster_by_tiles(SiteIndex first, Progress &progress) {
+  const NeighborOffsets offsets {grid_width, grid_height};
+  const std::size_t begin {cluster_sites.size()};
+  cluster_stack.clear();
+  auto take {
+    [&](SiteIndex i) {
+      Site* site {grid + i};
+      if (!site->open || site->flooded) {
+        return;
+      }
+      const Coords c {coords_of(i)};
+      const unsigned int tile_x {c.x / tile_size};
+      const unsigned int tile_y {c.y / tile_size};
+      if (tile_occupancy(tile_x, tile_y) != TileOccupancy::open) {
         site->flooded = true;
-        site->fresh = true;
-        freshly_flooded.emplace_back(x, y);
-        return true;
+        cluster_sites.push_back(i);
+        cluster_stack.push_back(i);
+        return;
       }
-      return false;
-    }};
-  for_each_site(
-    [&](int x, int y) {
-      if (begin_flooding_at(x, y)) {
-        flow_fully_(true, run);
-        clusters.emplace_back(new Cluster {current_cluster});
-        current_cluster.clear();
+      const int x_begin {static_cast<int>(tile_x * tile_size)};
+      const int x_end {static_cast<int>(std::min((tile_x + 1) * tile_size, grid_width))};
+      const int y_begin {static_cast<int>(tile_y * tile_size)};
+      const int y_end {static_cast<int>(std::min((tile_y + 1) * tile_size, grid_height))};
+      for (int y {y_begin}; y < y_end; ++y) {
+        Site* row {grid + index_of(0, y)};
+        for (int x {x_begin}; x < x_end; ++x) {
+          row[x].flooded = true;
+          cluster_sites.push_back(index_of(x, y));
+        }
       }
-    }, run);
-  freshly_flooded.clear();
+      for (int x {x_begin}; x < x_end; ++x) {
+        cluster_stack.push_back(index_of(x, y_begin));
+        cluster_stack.push_back(index_of(x, y_end - 1));
+      }
+      for (int y {y_begin}; y < y_end; ++y) {
+        cluster_stack.push_back(index_of(x_begin, y));
+        cluster_stack.push_back(index_of(x_end - 1, y));
+      }
+    }};
+  take(first);
+  const std::atomic_bool &run {progress.run_flag()};
+  while (!cluster_stack.empty() && run) {
+    const SiteIndex i {cluster_stack.back()};
+    cluster_stack.pop_back();
+    for_each_neighbor<Boundary>(grid, i, offsets, take);
+  }
+  progress.advance(cluster_sites.size() - begin - 1);
 }
 
-// Sort all clusters by size in descending order.
+// Records the cluster whose sites were appended to cluster_sites from begin on.
+void Lattice::add_cluster(std::size_t begin) {
+  const std::size_t size {cluster_sites.size() - begin};
+  if (size >= size_counts.size()) {
+    size_counts.resize(size + 1, 0);
+  }
+  ++size_counts[size];
+
+  // Keep the smallest of the largest clusters at the top of the heap, ready to be replaced.
+  auto larger {
+    [&](std::size_t a, std::size_t b) { return clusters[a].size > clusters[b].size; }};
+  clusters.push_back({begin, size});
+  if (largest_clusters.size() < num_largest_clusters) {
+    largest_clusters.push_back(clusters.size() - 1);
+    std::push_heap(largest_clusters.begin(), largest_clusters.end(), larger);
+  } else if (num_largest_clusters > 0 && size > clusters[largest_clusters.front()].size) {
+    std::pop_heap(largest_clusters.begin(), largest_clusters.end(), larger);
+    largest_clusters.back() = clusters.size() - 1;
+    std::push_heap(largest_clusters.begin(), largest_clusters.end(), larger);
+  }
+}
+
+// Sort all clusters by size in descending order. This is a counting sort, using the size counts
+// gathered by find_clusters().
 void Lattice::sort_clusters() {
-  std::sort(
-    // Enable parallelized sorting algorithm if we can.
-#ifdef HAVE_TBB
-    std::execution::par_unseq,
-#endif
-    clusters.begin(),
-    clusters.end(),
-    [&](const auto cluster1, const auto cluster2) {
-      return cluster1->size() > cluster2->size();
-    });
+  // Where the clusters of each size begin, the largest size first.
+  std::vector<std::size_t> positions(size_counts.size());
+  std::size_t position {0};
+  for (std::size_t size {size_counts.size()}; size-- > 0; ) {
+    positions[size] = position;
+    position += size_counts[size];
+  }
+  std::vector<ClusterExtent> sorted(clusters.size());
+  for (const auto &cluster : clusters) {
+    sorted[positions[cluster.size]++] = cluster;
+  }
+  clusters = std::move(sorted);
+  largest_clusters.resize(std::min(num_largest_clusters, clusters.size()));
+  std::iota(largest_clusters.begin(), largest_clusters.end(), 0);
+}
+
+// How many of the largest clusters the next find_clusters() keeps track of, for
+// sort_largest_clusters().
+void Lattice::set_num_largest_clusters(std::size_t k) {
+  num_largest_clusters = k;
+}
+
+// Moves the largest clusters (see set_num_largest_clusters()) to the front, in descending order
+// of size. The rest are left in the order they were found. This is much cheaper than
+// sort_clusters() when there are many clusters and only the largest few are of interest.
+void Lattice::sort_largest_clusters() {
+  std::sort(largest_clusters.begin(), largest_clusters.end(),
+            [&](std::size_t a, std::size_t b) {
+              return clusters[a].size > clusters[b].size ||
+                (clusters[a].size == clusters[b].size && a < b);
+            });
+  std::vector<bool> is_largest(clusters.size(), false);
+  std::vector<ClusterExtent> sorted;
+  sorted.reserve(clusters.size());
+  for (const auto i : largest_clusters) {
+    is_largest[i] = true;
+    sorted.push_back(clusters[i]);
+  }
+  for (std::size_t i {0}; i < clusters.size(); ++i) {
+    if (!is_largest[i]) {
+      sorted.push_back(clusters[i]);
+    }
+  }
+  clusters = std::move(sorted);
+  std::iota(largest_clusters.begin(), largest_clusters.end(), 0);
 }
 
 unsigned int Lattice::num_clusters() const {
   return clusters.size();
 }
 
+// The total size of all clusters.
+std::size_t Lattice::num_cluster_sites() const {
+  return cluster_sites.size();
+}
+
+// Element s is the number of clusters of size s. The last element is nonzero, unless there are no
+// clusters at all.
+std::span<const unsigned int> Lattice::cluster_size_counts() const {
+  return size_counts;
+}
+
 bool Lattice::done_percolation() {
   return begun_percolation and freshly_flooded.empty();
 }
 
+// Unfloods every site. This is free if nothing can be flooded (e.g., when find_clusters() follows
+// a reset). Otherwise the sites are cleared a word at a time, in parallel by blocks of rows, and
+// closed tiles are skipped, since nothing in them is ever flooded. That's still a pass over the
+// grid: about 20 ms for 10k x 10k at p_c, on one slow core.
 void Lattice::reset_percolation() {
-  for (auto i {0}; i < grid_width * grid_height; ++i) {
-    grid[i].flooded = false;
-  }
+  unflood_all();
   clear_clusters();
   freshly_flooded.clear();
+  flood_times.clear();
+  flow_step = 0;
+  recorded_flow_steps = 0;
   begun_percolation = false;
 }
 
+// The grid part of reset_percolation(): unfloods every site, skipping closed tiles, and does
+// nothing at all if nothing can be flooded.
+void Lattice::unflood_all() {
+  if (!maybe_flooded) {
+    return;
+  }
+  const unsigned int tiles_across {num_tiles_across()};
+  const std::atomic_bool run {true};
+  parallel_for_chunks(
+    grid_height, rows_per_block,
+    [&](std::size_t y_begin, std::size_t y_end) {
+      const TileOccupancy* tiles {tile_occupancies.data() + y_begin / tile_size * tiles_across};
+      for (auto y {y_begin}; y < y_end; ++y) {
+        Site* row {grid + index_of(0, y)};
+        unsigned int x {0};
+        while (x < grid_width) {
+          // Each run of tiles that aren't closed is cleared in one go.
+          unsigned int run_end {x / tile_size};
+          while (run_end < tiles_across && tiles[run_end] != TileOccupancy::closed) {
+            ++run_end;
+          }
+          const unsigned int x_end {std::min(run_end * tile_size, grid_width)};
+          if (x < x_end) {
+            unflood_sites(row + x, x_end - x);
+          }
+          x = (run_end + 1) * tile_size;
+        }
+      }
+    }, run);
+  maybe_flooded = false;
+}
+
 Site Lattice::get_site(int x, int y) const {
-  return grid[y * grid_width + x];
+  return grid[index_of(x, y)];
 }
-inline void Lattice::set_site(int x, int y, Site site) {
-  grid[y * grid_width + x] = site;
+void Lattice::set_site(int x, int y, Site site) {
+  site.ghost = false;
+  grid[index_of(x, y)] = site;
+  maybe_flooded = maybe_flooded || site.flooded;
+  forget_invasion();
+  TileOccupancy &tile {tile_occupancies[y / tile_size * num_tiles_across() + x / tile_size]};
+  if (tile != TileOccupancy::mixed && site.open != (tile == TileOccupancy::open)) {
+    tile = TileOccupancy::mixed;
+  }
+  if (torus && (x == 0 || y == 0 || x == grid_width - 1 || y == grid_height - 1)) {
+    update_border();
+  }
 }
 bool Lattice::is_open(int x, int y) const {
   return get_site(x,y).open;
@@ -411,35 +1474,172 @@ bool Lattice::is_freshly_flooded(int x, int y) const {
   return site.flooded && site.fresh;
 }
 
-void Lattice::for_each_site(std::function<void (int, int)> f, std::atomic_bool &run) const {
-  for (auto y {0}; y < grid_height && run; ++y) {
-    for (auto x {0}; x < grid_width && run; ++x) {
-      f(x, y);
-    }
-  }
+// Copies the grid and the clusters from rhs, in parallel chunks. Stops early if run becomes false.
+// The progress is measured in bytes copied.
+void Lattice::copy_contents(const Lattice& rhs, Progress &progress) {
+  std::atomic_bool &run {progress.run_flag()};
+  progress.start(grid_size() * sizeof(Site) +
+                 rhs.flood_times.size() * sizeof(uint32_t) +
+                 rhs.cluster_sites.size() * sizeof(SiteIndex));
+  allocate_grid(false);  // Every byte is copied over below.
+  tile_occupancies = rhs.tile_occupancies;
+  constexpr std::size_t grid_chunk_size {1 << 22};  // Bytes
+  parallel_for_chunks(
+    grid_size(), grid_chunk_size,
+    [&](std::size_t begin, std::size_t end) {
+      std::memcpy(grid + begin, rhs.grid + begin, end - begin);
+      progress.advance((end - begin) * sizeof(Site));
+    }, run);
+
+  flood_times.resize(rhs.flood_times.size());
+  parallel_for_chunks(
+    flood_times.size(), grid_chunk_size / sizeof(uint32_t),
+    [&](std::size_t begin, std::size_t end) {
+      std::copy(rhs.flood_times.begin() + begin, rhs.flood_times.begin() + end,
+                flood_times.begin() + begin);
+      progress.advance((end - begin) * sizeof(uint32_t));
+    }, run);
+
+  cluster_sites.resize(rhs.cluster_sites.size());
+  parallel_for_chunks(
+    cluster_sites.size(), grid_chunk_size / sizeof(SiteIndex),
+    [&](std::size_t begin, std::size_t end) {
+      std::copy(rhs.cluster_sites.begin() + begin, rhs.cluster_sites.begin() + end,
+                cluster_sites.begin() + begin);
+      progress.advance((end - begin) * sizeof(SiteIndex));
+    }, run);
 }
 
-void Lattice::for_each_cluster(std::function<void (Cluster)> f, std::atomic_bool &run) const {
-  for (auto cluster : clusters) {
-    if (!run) { break; }
-    f(*cluster);
+// Allocates memory for the lattice, but does not initialize it. Leaves the lattice in an invalid
+// state: The caller must subsequently fill the lattice by calling fill().
+//
+// Unless clear is false, the grid is zeroed in the same blocks of rows that fill() works on, on
+// the thread pool, so that on a NUMA machine its pages are spread among the nodes rather than all
+// put on this thread's. (Which thread takes which block is up to the pool, so the spread is only
+// statistical.) Pass false only when every byte is about to be overwritten, in parallel chunks
+// that touch the pages first instead, as copy_contents() does: zeroing would write each page twice.
+void Lattice::allocate_grid(bool clear) {
+  tile_occupancies.assign(static_cast<std::size_t>(num_tiles_across()) * num_tiles_down(),
+                          TileOccupancy::mixed);
+  grid = static_cast<Site*>(allocate_pages(grid_size()));
+  if (!clear) {
+    return;
   }
+  const std::atomic_bool touch_all {true};
+  parallel_for_chunks(
+    grid_height, rows_per_block,
+    [&](std::size_t y_begin, std::size_t y_end) {
+      // The borders above and below go with the first and last blocks.
+      const std::size_t begin {y_begin == 0 ? 0 : index_of(-1, y_begin)};
+      const std::size_t end {y_end == grid_height ? grid_size() : index_of(-1, y_end)};
+      std::memset(static_cast<void*>(grid + begin), 0, end - begin);
+    }, touch_all);
 }
 
-// Allocates memory for the lattice, but does not initialize it. Leaves the lattice in an invalid
-// state, possibly containing garbage data: The caller must subsequently fill the lattice by
-// calling fill().
-void Lattice::allocate_grid() {
-  grid = new Site[grid_width * grid_height] ();
+// Where the grid's memory ended up (see allocate_pages()).
+MemoryPlacement Lattice::grid_placement() const {
+  return memory_placement(grid, grid_size());
 }
 
-void Lattice::clear_clusters() {
-  for (auto cluster : clusters) {
-    delete cluster;
+// Makes the border of the grid closed, or, in torus mode, a copy of the opposite edges.
+void Lattice::update_border() {
+  Site border_site;
+  std::memset(&border_site, 0, sizeof(border_site));
+  border_site.ghost = torus;
+  const SiteIndex stride {grid_stride()};
+  const SiteIndex last_row {(grid_height + 1) * stride};
+  for (SiteIndex x {1}; x <= grid_width; ++x) {
+    border_site.open = torus && grid[grid_height * stride + x].open;
+    grid[x] = border_site;
+    border_site.open = torus && grid[stride + x].open;
+    grid[last_row + x] = border_site;
+  }
+  for (SiteIndex row {stride}; row < last_row; row += stride) {
+    border_site.open = torus && grid[row + grid_width].open;
+    grid[row] = border_site;
+    border_site.open = torus && grid[row + 1].open;
+    grid[row + grid_width + 1] = border_site;
   }
+}
+
+void Lattice::clear_clusters() {
   clusters.clear();
+  cluster_sites.clear();
+  size_counts.clear();
+  largest_clusters.clear();
 }
 
 Site* Lattice::get_site_ptr(int x, int y) {
-  return grid + (y * grid_width + x);
+  return grid + index_of(x, y);
+}
+
+// The distance between vertically adjacent sites.
+SiteIndex Lattice::grid_stride() const {
+  return grid_width + 2;
+}
+
+// The number of sites in the grid, border included.
+std::size_t Lattice::grid_size() const {
+  return static_cast<std::size_t>(grid_width + 2) * (grid_height + 2);
+}
+
+SiteIndex Lattice::index_of(int x, int y) const {
+  return (y + 1) * grid_stride() + (x + 1);
+}
+
+Coords Lattice::coords_of(SiteIndex site) const {
+  return Coords(site % grid_stride() - 1, site / grid_stride() - 1);
+}
+
+// Empties the frontier, which will hold sites of a lattice with num_sites sites, and chooses its
+// representation.
+void Frontier::reset(std::size_t lattice_num_sites, bool make_dense) {
+  num_sites = lattice_num_sites;
+  dense = make_dense;
+  sites.clear();
+  dense_size = 0;
+  if (dense) {
+    bitmap.assign((num_sites + 63) / 64, 0);
+  } else {
+    bitmap.clear();
+  }
+}
+
+// Empties the frontier, making it sparse.
+void Frontier::clear() {
+  dense = false;
+  sites.clear();
+  bitmap.clear();
+  dense_size = 0;
+}
+
+// Replaces the frontier by a list of sites (of the same lattice as before). Call settle()
+// afterwards to pick the best representation.
+void Frontier::assign(std::vector<SiteIndex> &&new_sites) {
+  clear();
+  sites = std::move(new_sites);
+}
+
+// Recounts the sites (after add_atomically()) and switches to whichever representation suits the
+// current size. There's some slack in the thresholds, so that a frontier of borderline size won't
+// be converted back and forth.
+void Frontier::settle() {
+  if (dense) {
+    dense_size = 0;
+    for (auto word : bitmap) {
+      dense_size += std::popcount(word);
+    }
+    if (!should_be_dense(dense_size * 2, num_sites)) {
+      std::vector<SiteIndex> list;
+      list.reserve(dense_size);
+      for_each([&](SiteIndex i) { list.push_back(i); });
+      assign(std::move(list));
+    }
+  } else if (should_be_dense(sites.size() / 2, num_sites)) {
+    std::vector<SiteIndex> list {std::move(sites)};
+    reset(num_sites, true);
+    for (auto i : list) {
+      add(i);
+    }
+  }
 }
@@ -1,18 +1,29 @@
 #ifndef LATTICE_H
 #define LATTICE_H
 
+#include <algorithm>
 #include <atomic>
+#include <bit>
+#include <cstdint>
 #include <cstring>
 #include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <type_traits>
 #include <vector>
 
+#include "random.h"
+#include "utility.h"
+
+class StrengthQueue;  // See invasion.h
 
 #pragma pack(push, 1)  // Only use 1 byte per Site
 struct Site {
   bool open : 1;
   bool flooded : 1;
   bool fresh : 1;
-  bool :1;  // padding
+  bool ghost : 1;  // Part of the grid's border in torus mode; see Lattice.
   bool connected_up : 1;
   bool connected_down : 1;
   bool connected_left : 1;
@@ -32,18 +43,141 @@ public:
 };
 
 enum class FlowDirection : int {top, all_sides};
+// An ordinary flow floods every open site it can reach, a wave at a time. An invasion takes one
+// open site per step: the weakest on its perimeter. See Lattice::set_flow_model().
+enum class FlowModel : int {ordinary, invasion};
+enum class TileOccupancy : uint8_t {closed, open, mixed};
 enum class PercolationMode {flow, clusters};
 
+// The answer to Lattice::percolates().
+struct SpanningResult {
+  bool percolates;
+  std::size_t sites_touched;  // The number of open sites the search reached before it stopped.
+};
+
 namespace measure {
-  using filler = std::function<bool (int, int)>;
+  // f(x, y, rng) says whether site (x, y) is open. Any randomness must come from rng.
+  //
+  // A Bernoulli filler also knows its p, so that Lattice::fill() can skip calling it and generate
+  // whole rows of sites at once instead (see BernoulliStream). The sites come out different from
+  // calling f, but with the same distribution.
+  class filler {
+  public:
+    template <typename F>
+      requires (!std::is_same_v<std::remove_cvref_t<F>, filler>)
+    filler(F f, std::optional<double> bernoulli_probability = std::nullopt,
+           unsigned int bernoulli_precision = 64)
+      : function {std::move(f)}
+      , p {bernoulli_probability}
+      , precision {bernoulli_precision}
+      , stateless {std::is_empty_v<std::remove_cvref_t<F>>}
+    {}
+
+    // Whether two fillers surely fill alike: Bernoulli fillers with the same p and precision, or
+    // fillers made from the same captureless function (as open() and the patterns are). Others
+    // never compare equal, even to themselves, since what they capture can't be compared.
+    bool operator==(const filler &rhs) const {
+      if (p || rhs.p) {
+        return p == rhs.p && precision == rhs.precision;
+      }
+      return stateless && rhs.stateless && function.target_type() == rhs.function.target_type();
+    }
+
+    bool operator()(int x, int y, RandomStream &rng) const {
+      return function(x, y, rng);
+    }
+    std::optional<double> bernoulli_p() const {
+      return p;
+    }
+    // The number of binary digits of p that count.
+    unsigned int bernoulli_precision() const {
+      return precision;
+    }
+
+  private:
+    std::function<bool (int, int, RandomStream &)> function;
+    std::optional<double> p;
+    unsigned int precision;
+    bool stateless;  // Whether function captures nothing, so that its type says what it does
+  };
   filler open();
   filler pattern_1();
   filler pattern_2();
   filler pattern_3();
-  filler bernoulli(double p);
+  filler bernoulli(double p, unsigned int precision = 64);
 };
 
-using Cluster = std::vector<Coords>;
+// Internally, sites are identified by their index in the grid. Coords are used only at the
+// interface.
+using SiteIndex = uint32_t;
+
+// The sites flooded in the most recent step of a flow. A sparse frontier is kept as a list of site
+// indices; a dense one, holding a sizeable fraction of the lattice, as a bitmap, which is smaller.
+class Frontier {
+public:
+  void reset(std::size_t num_sites, bool dense);
+  void clear();
+  void assign(std::vector<SiteIndex> &&sites);
+  void settle();
+
+  bool is_dense() const { return dense; }
+  bool empty() const { return size() == 0; }
+  std::size_t size() const { return dense ? dense_size : sites.size(); }
+  static bool should_be_dense(std::size_t size, std::size_t num_sites) {
+    return size * 32 > num_sites;
+  }
+
+  void add(SiteIndex site) {
+    if (dense) {
+      bitmap[site / 64] |= uint64_t {1} << (site % 64);
+      ++dense_size;
+    } else {
+      sites.push_back(site);
+    }
+  }
+  // Only for a dense frontier. Call settle() afterwards to update size().
+  void add_atomically(SiteIndex site) {
+    std::atomic_ref<uint64_t> word {bitmap[site / 64]};
+    word.fetch_or(uint64_t {1} << (site % 64), std::memory_order_relaxed);
+  }
+
+  // The sites are visited by "slot": an entry of the list, or a word of the bitmap. A range of
+  // slots is the unit of work when splitting a frontier among threads.
+  std::size_t num_slots() const { return dense ? bitmap.size() : sites.size(); }
+  template <typename F>
+  void for_each_in_slots(std::size_t begin, std::size_t end, F f) const {
+    if (dense) {
+      for (auto w {begin}; w < end; ++w) {
+        for (uint64_t word {bitmap[w]}; word != 0; word &= word - 1) {
+          f(static_cast<SiteIndex>(w * 64 + std::countr_zero(word)));
+        }
+      }
+    } else {
+      for (auto i {begin}; i < end; ++i) {
+        f(sites[i]);
+      }
+    }
+  }
+  // Stops early (leaving the rest unvisited) if run becomes false.
+  template <typename F>
+  void for_each(F f, const std::atomic_bool &run) const {
+    constexpr std::size_t slots_per_check {1 << 10};
+    for (std::size_t begin {0}; begin < num_slots() && run; begin += slots_per_check) {
+      for_each_in_slots(begin, std::min(begin + slots_per_check, num_slots()), f);
+    }
+  }
+  template <typename F>
+  void for_each(F f) const {
+    for_each_in_slots(0, num_slots(), f);
+  }
+
+private:
+  std::size_t num_sites {0};
+  bool dense {false};
+  std::vector<SiteIndex> sites;
+  std::vector<uint64_t> bitmap;
+  std::size_t dense_size {0};
+};
 
 class Lattice {
 public:
@@ -53,6 +187,7 @@ public:
   // TODO Write all copy/move constructors
   Lattice() =delete;
   Lattice(const Lattice& rhs);
+  Lattice(const Lattice& rhs, Progress &progress);
   Lattice(Lattice&&) =delete;
   Lattice& operator=(const Lattice&) =delete;
   Lattice& operator=(Lattice&&) =delete;
@@ -64,17 +199,33 @@ public:
 
   FlowDirection get_flow_direction();
   void set_flow_direction(FlowDirection direction);
+  FlowModel get_flow_model() const;
+  void set_flow_model(FlowModel model);
+  void set_trapping(bool is_trapping);
   void set_torus(bool is_torus);
   bool is_torus() const;
 
-  void fill(measure::filler gen, std::atomic_bool &run);
+  void fill(measure::filler gen, uint64_t seed, Progress &progress,
+            RandomEngine engine = default_random_engine);
 
-  bool flood_entryways();
+  bool flood_entryways(std::atomic_bool &run);
   bool flow_one_step(std::atomic_bool &run);
-  void flow_fully(std::atomic_bool &run);
-  void find_clusters(std::atomic_bool &run);
+  void flow_fully(Progress &progress);
+  void set_record_flood_times(bool record);
+  unsigned int num_flow_steps() const;
+  unsigned int num_recorded_flow_steps() const;
+  bool seek_flow(unsigned int step, std::atomic_bool &run);
+  std::vector<unsigned int> flood_time_histogram() const;
+  std::optional<SpanningResult> percolates(bool bidirectional, Progress &progress) const;
+  static std::optional<bool> check_parallel_flow(unsigned int width, unsigned int height, double p,
+                                                 uint64_t seed, std::atomic_bool &run);
+  void find_clusters(Progress &progress);
   void sort_clusters();
+  void set_num_largest_clusters(std::size_t k);
+  void sort_largest_clusters();
   unsigned int num_clusters() const;
+  std::size_t num_cluster_sites() const;
+  std::span<const unsigned int> cluster_size_counts() const;
   bool done_percolation();
   void reset_percolation();
 
@@ -84,32 +235,157 @@ public:
   bool is_flooded(int x, int y) const;
   bool is_freshly_flooded(int x, int y) const;
 
-  void for_each_site(std::function<void (int, int)> f, std::atomic_bool &run) const;
-  void for_each_cluster(std::function<void (Cluster)> f, std::atomic_bool &run) const;
+  // Site indices, as passed by for_each_cluster(). The grid is stored row by row, grid_stride()
+  // apart, inside a border one site thick; grid_size() counts the border, too.
+  SiteIndex index_of(int x, int y) const;
+  Coords coords_of(SiteIndex site) const;
+  SiteIndex grid_stride() const;
+  std::size_t grid_size() const;
+  MemoryPlacement grid_placement() const;
+
+  // A coarse summary of the lattice, in square tiles of tile_size sites a side (smaller at the
+  // right and bottom edges): whether each tile's sites are all closed, all open, or mixed. It lets
+  // kernels skip closed tiles, and take open ones whole. fill() and set_site() keep it up to date.
+  // A tile may be called mixed even if it isn't, but never the other way around.
+  static constexpr unsigned int tile_size {64};
+  TileOccupancy tile_occupancy(unsigned int tile_x, unsigned int tile_y) const;
+  unsigned int num_tiles_across() const;
+  unsigned int num_tiles_down() const;
+
+  // fill() works on blocks of this many rows, block k from random stream k of the seed. Anything
+  // that makes the same lattice without a Lattice (see BitslicedLattice::fill()) must use the same
+  // blocks. Each block is one row of tiles, which fill() summarizes as it goes.
+  static constexpr unsigned int fill_block_rows {tile_size};
+
+  // Visitors. The flag run is checked once per row, or once per cluster: if it becomes false, the
+  // visit stops early.
+  // f(y, row), where row points to the width sites of row y.
+  template <typename F> void for_each_row(F f, const std::atomic_bool &run) const;
+  // f(x, y)
+  template <typename F> void for_each_site(F f, const std::atomic_bool &run) const;
+  // f(sites), where sites is a std::span<const SiteIndex> (see index_of()).
+  template <typename F> void for_each_cluster(F f, const std::atomic_bool &run) const;
 
 private:
+  // The grid has a border one site thick around the lattice, so that neighbors can be found
+  // without bounds checks. Normally the border is closed. In torus mode it's made of "ghost"
+  // sites, each a copy of the site on the opposite edge: flowing into a ghost continues at the
+  // site it mirrors.
   Site* grid;
   unsigned int grid_width;
   unsigned int grid_height;
   bool begun_percolation;
+  bool maybe_flooded;  // False only if no site is flooded, so that there's nothing to reset
   FlowDirection flow_direction;
   bool torus {false};
-  std::vector<Coords> freshly_flooded;
-
-  // For some reason, sorting a vector of raw pointers is *much* faster than sorting a vector of
-  // vectors. But why? The difference in memory is not that large: sizeof(&Cluster) == 8;
-  // sizeof(Cluster) == 24.
-  // TODO Keep clusters in our own contiguous data structure: Otherwise, allocating/deallocating
-  // all clusters is very slow, which includes e.g. destructing a Lattice.
-  std::vector<Cluster*> clusters;
-  Cluster current_cluster;
-
-  bool flow_one_step_torus(std::atomic_bool &run);
-  void flow_fully_(bool track_cluster, std::atomic_bool &run);
-  void allocate_grid();
+  Frontier freshly_flooded;
+  Frontier next_frontier;  // Scratch space for flow_one_step()
+  // Whether flow_one_step() expands the frontier in parallel. Normally it's up to the size of the
+  // frontier and the number of cores; check_parallel_flow() forces it either way. Not copied.
+  std::optional<bool> parallel_flow;
+
+  // Flood-time map: the step at which each site was flooded (0 if never), recorded during flow so
+  // that any step of the flow can be recovered with seek_flow(). Empty unless recording.
+  bool record_flood_times {false};
+  std::vector<uint32_t> flood_times;
+  unsigned int flow_step {0};
+  unsigned int recorded_flow_steps {0};
+
+  // All clusters' sites are kept in one contiguous array, cluster after cluster, so that they're
+  // cheap to allocate, copy and destroy. Sorting clusters only shuffles their extents.
+  struct ClusterExtent {
+    std::size_t begin;
+    std::size_t size;
+  };
+  std::vector<ClusterExtent> clusters;
+  std::vector<SiteIndex> cluster_sites;
+  // Gathered while finding clusters: the number of clusters of each size (a counting sort, since
+  // no cluster is bigger than the lattice), and a min-heap of the indices of the
+  // num_largest_clusters largest clusters, for sort_largest_clusters().
+  std::vector<unsigned int> size_counts;
+  std::vector<std::size_t> largest_clusters;
+  std::size_t num_largest_clusters {64};
+  std::vector<SiteIndex> cluster_stack;  // Scratch space for flood_cluster_by_tiles()
+
+  std::vector<TileOccupancy> tile_occupancies;  // Row by row
+
+  // Invasion percolation (see set_flow_model()). The strengths of the sites are drawn from
+  // strength_key, which fill() sets. The sites taken are listed in invasion, in order, and each
+  // step (after a rewind, too) takes the next one from there. The list is only worked out as far as
+  // it's needed, from the invader's perimeter, which is kept from one step to the next; except that
+  // trapping needs the whole invasion first (see remove_trapped_sites()). Copies of the lattice
+  // don't get the list: they work it out again if they're taken any further.
+  FlowModel flow_model {FlowModel::ordinary};
+  bool trapping {false};
+  uint64_t strength_key {0};
+  std::vector<SiteIndex> invasion;
+  bool invasion_complete {false};  // Whether invasion has every site that will be taken
+  std::unique_ptr<StrengthQueue> invader_perimeter;  // As of the last site in invasion
+
+  // The kernels are specialized at compile time by boundary policy (open edges or torus) and by
+  // entry policy (flow direction); see lattice.cpp. The public functions dispatch to them.
+  template <typename Entry> bool flood_entryways_();
+  template <typename Boundary> bool flow_one_step_(std::atomic_bool &run);
+  template <typename Boundary> bool flow_one_step_parallel_(std::atomic_bool &run);
+  template <typename Boundary> void flow_until_done(bool track_cluster, Progress &progress);
+  template <typename Boundary> void find_clusters_(Progress &progress);
+  template <typename Boundary> void flood_cluster_by_tiles(SiteIndex first, Progress &progress);
+  template <typename Boundary, typename Entry>
+  bool extend_invasion_(std::size_t num_steps, Progress &progress);
+  bool extend_invasion(std::size_t num_steps, Progress &progress);
+  void forget_invasion();
+  void remove_trapped_sites(std::vector<SiteIndex> &order) const;
+  bool begin_invasion(Progress &progress);
+  bool invade_one_step(Progress &progress);
+  void invade_fully(Progress &progress);
+  void summarize_tiles(unsigned int tile_y);
+  std::optional<SpanningResult> spans_from_top(Progress &progress) const;
+  std::optional<SpanningResult> spans_from_top_and_bottom(Progress &progress) const;
+  std::optional<SpanningResult> wraps_vertically(Progress &progress) const;
+  void begin_flow_step();
+  bool finish_flow_step();
+  void forget_flood_times_after(unsigned int step);
+  void copy_contents(const Lattice& rhs, Progress &progress);
+  void allocate_grid(bool clear = true);
+  void unflood_all();
+  void update_border();
   void clear_clusters();
+  void add_cluster(std::size_t begin);
 
+  template <typename F> void for_each_row_mutable(F f, const std::atomic_bool &run);
   Site* get_site_ptr(int x, int y);
 };
 
+template <typename F>
+void Lattice::for_each_row(F f, const std::atomic_bool &run) const {
+  for (unsigned int y {0}; y < grid_height && run; ++y) {
+    f(y, static_cast<const Site*>(grid + index_of(0, y)));
+  }
+}
+
+template <typename F>
+void Lattice::for_each_row_mutable(F f, const std::atomic_bool &run) {
+  for (unsigned int y {0}; y < grid_height && run; ++y) {
+    f(y, grid + index_of(0, y));
+  }
+}
+
+template <typename F>
+void Lattice::for_each_site(F f, const std::atomic_bool &run) const {
+  for_each_row(
+    [&](int y, const Site*) {
+      for (int x {0}; x < static_cast<int>(grid_width); ++x) {
+        f(x, y);
+      }
+    }, run);
+}
+
+template <typename F>
+void Lattice::for_each_cluster(F f, const std::atomic_bool &run) const {
+  for (const auto &extent : clusters) {
+    if (!run) { break; }
+    f(std::span<const SiteIndex> {cluster_sites.data() + extent.begin, extent.size});
+  }
+}
+
 #endif  // LATTICE_H
@@ -1,6 +1,8 @@
 #include <algorithm>
+#include <array>
+#include <future>
 #include <iostream>
-#include <map>
+#include <optional>
 #include <string>
 
 #ifdef _WIN32
@@ -20,6 +22,10 @@
 
 #include "lattice.h"
 #include "supervisor.h"
+#include "ensemble.h"
+#include "bernoulli.h"
+#include "invasion.h"
+#include "tiledlattice.h"
 #include "graphics/latticewindow.h"
 
 // TODO Find a better way of dealing with this and regenerate_lattice().
@@ -79,31 +85,31 @@ static void show_main_menu(GLFWwindow* window, bool &about_window_visible) {
   }
 }
 
-// TODO Expunge this evil function.
-void regenerate_lattice(Supervisor &supervisor, const MeasureID gui_measure, const float p) {
+static measure::filler make_measure(const MeasureID gui_measure, const float p,
+                                    const unsigned int precision) {
   switch (gui_measure) {
   case MeasureID::open:
-    supervisor.set_measure(measure::open());
-    break;
+    return measure::open();
   case MeasureID::pattern_1:
-    supervisor.set_measure(measure::pattern_1());
-    break;
+    return measure::pattern_1();
   case MeasureID::pattern_2:
-    supervisor.set_measure(measure::pattern_2());
-    break;
+    return measure::pattern_2();
   case MeasureID::pattern_3:
-    supervisor.set_measure(measure::pattern_3());
-    break;
+    return measure::pattern_3();
   case MeasureID::bernoulli:
-    supervisor.set_measure(measure::bernoulli(p));
-    break;
+    return measure::bernoulli(p, precision);
   default:
     IM_ASSERT(false);
-    break;
+    return measure::open();
   }
-  supervisor.fill();
 }
 
+// TODO Expunge this evil function.
+void regenerate_lattice(Supervisor &supervisor, const MeasureID gui_measure, const float p,
+                        const unsigned int precision) {
+  supervisor.set_measure(make_measure(gui_measure, p, precision));
+  supervisor.fill();
+}
 
 void handle_keyboard_input(GLFWwindow* window) {
   // Ctrl-Q should work everywhere, even if ImGui wants to capture keyboard.
@@ -339,7 +345,16 @@ int main(int, char**) {
   // GUI state variables
 #ifdef DEVEL_FEATURES
   auto demo_window_visible {false};
+  // Row-major (Lattice) against tiled (TiledLattice) storage: see "Benchmark layouts". The task
+  // is stopped on exit, rather than left to run to the end.
+  std::future<std::vector<LayoutBenchmark>> benchmark_task;
+  std::vector<LayoutBenchmark> benchmarks;
+  std::atomic_bool benchmark_running {true};
+  std::shared_ptr<const ClusterSizeHistogram> cluster_sizes;  // The latest one fetched
 #endif
+  // A batch of samples (see "Batch"). Like the benchmark, it's stopped on exit while the shared
+  // thread pool is still there to finish the samples in progress.
+  std::unique_ptr<Ensemble> ensemble;
   auto lattice_window_visible {true};
   auto about_window_visible {false};
 
@@ -348,11 +363,16 @@ int main(int, char**) {
   auto gui_measure {MeasureID::bernoulli};
   const float rect_site_percolation_threshold {0.59274605F};
   float bernoulli_p {rect_site_percolation_threshold};
+  unsigned int bernoulli_precision {64};  // Binary digits of p
+  auto random_engine {default_random_engine};
 
   auto percolation_mode {PercolationMode::flow};
   float flow_speed {20.0F};
   FlowDirection flow_direction {FlowDirection::top};
+  FlowModel flow_model {FlowModel::ordinary};
+  bool trapping {false};
   bool torus {false};
+  auto record_timeline {false};
   auto auto_percolate {false};
   auto auto_flow {false};
   auto auto_find_clusters {false};
@@ -361,7 +381,10 @@ int main(int, char**) {
   auto supervisor {Supervisor(lattice_size, lattice_size, measure::pattern_3())};
   supervisor.set_flow_speed(flow_speed);
   supervisor.set_flow_direction(flow_direction);
+  supervisor.set_flow_model(flow_model);
+  supervisor.set_trapping(trapping);
   supervisor.set_torus(torus);
+  supervisor.set_record_flood_times(record_timeline);
 
   LatticeWindow lattice_window {"Lattice"};
 
@@ -378,7 +401,7 @@ int main(int, char**) {
       }
     }};
 
-  regenerate_lattice(supervisor, gui_measure, bernoulli_p);
+  regenerate_lattice(supervisor, gui_measure, bernoulli_p, bernoulli_precision);
   do_autos_if_needed();
 
   // Main loop
@@ -444,7 +467,7 @@ int main(int, char**) {
             if (lattice_size != previous_lattice_size) {
               supervisor.stop_flow();
               supervisor.set_size(lattice_size, lattice_size);
-              regenerate_lattice(supervisor, gui_measure, bernoulli_p);
+              regenerate_lattice(supervisor, gui_measure, bernoulli_p, bernoulli_precision);
               do_autos_if_needed();
             }
           }
@@ -480,7 +503,7 @@ int main(int, char**) {
             if (gui_measure != previous_gui_measure) {
               supervisor.stop_flow();
               supervisor.abort();
-              regenerate_lattice(supervisor, gui_measure, bernoulli_p);
+              regenerate_lattice(supervisor, gui_measure, bernoulli_p, bernoulli_precision);
               do_autos_if_needed();
             }
           }
@@ -493,7 +516,7 @@ int main(int, char**) {
               bernoulli_p = clamp(bernoulli_p, 0.0F, 1.0F);
               if (bernoulli_p != previous_bernoulli_p) {
                 supervisor.stop_flow();
-                regenerate_lattice(supervisor, gui_measure, bernoulli_p);
+                regenerate_lattice(supervisor, gui_measure, bernoulli_p, bernoulli_precision);
                 do_autos_if_needed();
               }
             }
@@ -505,13 +528,57 @@ int main(int, char**) {
 
             ImGui::SameLine();
             help_marker("The probability of each site being open. Ctrl-click for keyboard input.");
+            static const unsigned int min_precision {1};
+            static const unsigned int max_precision {64};
+            if (ImGui::SliderScalar("Precision", ImGuiDataType_U32, &bernoulli_precision,
+                                    &min_precision, &max_precision, "%u bits")) {
+              bernoulli_precision = clamp(bernoulli_precision, min_precision, max_precision);
+              supervisor.stop_flow();
+              regenerate_lattice(supervisor, gui_measure, bernoulli_p, bernoulli_precision);
+              do_autos_if_needed();
+            }
+            ImGui::SameLine();
+            help_marker("The number of binary digits of p that are used; the rest are dropped. "
+                        "Fewer digits make filling slightly faster.");
+            if (ImGui::Combo("Random engine", (int*)&random_engine, random_engine_names,
+                             (int)RandomEngine::MAX)) {
+              supervisor.set_random_engine(random_engine);
+              supervisor.abort();
+              regenerate_lattice(supervisor, gui_measure, bernoulli_p, bernoulli_precision);
+              do_autos_if_needed();
+            }
+            ImGui::SameLine();
+            help_marker("The pseudorandom number generator, from fastest to best. Only "
+                        "xoshiro256++ fills with vector instructions; the others are several times "
+                        "slower. Philox is counter based, as used by GPU libraries.");
             if (ImGui::Button("Randomize")) {
-              // TODO Let the user choose the RNG -- there's a tradeoff between speed and quality.
-              // Choices: Xorshift32, PCG, ...?
               supervisor.abort();
-              regenerate_lattice(supervisor, gui_measure, bernoulli_p);
+              regenerate_lattice(supervisor, gui_measure, bernoulli_p, bernoulli_precision);
+              do_autos_if_needed();
+            }
+            // While being edited, the field keeps its own copy of the text.
+            uint64_t seed {supervisor.get_seed()};
+            if (ImGui::InputScalar("Seed", ImGuiDataType_U64, &seed, nullptr, nullptr, "%llu",
+                                   ImGuiInputTextFlags_EnterReturnsTrue)) {
+              supervisor.set_seed(seed);
+              supervisor.abort();
+              regenerate_lattice(supervisor, gui_measure, bernoulli_p, bernoulli_precision);
               do_autos_if_needed();
             }
+            ImGui::SameLine();
+            // Not necessarily the engine chosen above, until the lattice has been refilled.
+            ImGui::Text("(%s)", random_engine_names[(int)supervisor.get_random_engine()]);
+            ImGui::SameLine();
+            help_marker("The seed that the lattice was filled with, and (in parentheses) the "
+                        "engine it was filled by. Enter a seed to fill the lattice with it.");
+            static bool prefill {false};
+            if (ImGui::Checkbox("Prefill next lattice", &prefill)) {
+              supervisor.set_pipelined(prefill);
+            }
+            ImGui::SameLine();
+            help_marker("Fill the next lattice in the background while this one is being "
+                        "percolated, so that randomizing again is much faster. Uses twice the "
+                        "memory.");
           }
           ImGui::Spacing();
           ImGui::Spacing();
@@ -627,21 +694,107 @@ int main(int, char**) {
             if (ImGui::RadioButton(torus ? "From top / bottom" : "From top",
                                    (int *)&flow_direction, (int)FlowDirection::top)) {
               supervisor.set_flow_direction(flow_direction);
-              supervisor.flood_entryways();
-              if (auto_percolate) {
-                supervisor.reset_percolation();  // Clear whatever came "from all sides".
-                supervisor.flow_fully();
+              if (flow_model == FlowModel::invasion) {
+                // An invasion can't take on new entryways midway: start over.
+                supervisor.reset_percolation();
+                do_autos_if_needed();
+              } else {
+                supervisor.flood_entryways();
+                if (auto_percolate) {
+                  supervisor.reset_percolation();  // Clear whatever came "from all sides".
+                  supervisor.flow_fully();
+                }
               }
             }
             ImGui::SameLine();
             if (ImGui::RadioButton("From all sides",
                                    (int *)&flow_direction, (int)FlowDirection::all_sides)) {
               supervisor.set_flow_direction(flow_direction);
-              supervisor.flood_entryways();
-              if (auto_percolate) {
-                supervisor.flow_fully();
+              if (flow_model == FlowModel::invasion) {
+                supervisor.reset_percolation();
+                do_autos_if_needed();
+              } else {
+                supervisor.flood_entryways();
+                if (auto_percolate) {
+                  supervisor.flow_fully();
+                }
               }
             }
+
+            ImGui::AlignTextToFramePadding();
+            ImGui::Text("Model:"); ImGui::SameLine();
+            const auto previous_flow_model {flow_model};
+            ImGui::RadioButton("Ordinary", (int *)&flow_model, (int)FlowModel::ordinary);
+            ImGui::SameLine();
+            ImGui::RadioButton("Invasion", (int *)&flow_model, (int)FlowModel::invasion);
+            if (flow_model != previous_flow_model) {
+              supervisor.set_flow_model(flow_model);
+              supervisor.reset_percolation();
+              do_autos_if_needed();
+            }
+            ImGui::SameLine();
+            help_marker("In invasion percolation, each site has a random strength, and the fluid "
+                        "takes one site per step: the weakest one it touches. Flowing from the "
+                        "top, it stops when it reaches the bottom.");
+            if (flow_model == FlowModel::invasion) {
+              if (ImGui::Checkbox("Trapping", &trapping)) {
+                supervisor.set_trapping(trapping);
+                supervisor.reset_percolation();
+                do_autos_if_needed();
+              }
+              ImGui::SameLine();
+              help_marker("The fluid being displaced can't be compressed, so it can't be invaded "
+                          "once it's cut off from the bottom. Only when flowing from the top, and "
+                          "not on a torus.");
+            }
+
+            if (ImGui::Checkbox("Record timeline", &record_timeline)) {
+              supervisor.set_record_flood_times(record_timeline);
+              supervisor.reset_percolation();
+              do_autos_if_needed();
+            }
+            ImGui::SameLine();
+            help_marker("Remember the step at which each site is flooded, so that any step of the "
+                        "flow can be revisited instantly. Uses 4 bytes of memory per site.");
+            if (record_timeline) {
+              // While the slider is being dragged, it shouldn't jump back and forth as the
+              // supervisor catches up.
+              static int timeline_step {0};
+              static bool timeline_active {false};
+              const int recorded_steps = supervisor.num_recorded_flow_steps();
+              if (!timeline_active) {
+                timeline_step = supervisor.num_flow_steps();
+              }
+              if (recorded_steps == 0) {
+                begin_disable_items();
+                ImGui::SliderInt("Step", &timeline_step, 0, 0);
+                end_disable_items();
+              } else if (ImGui::SliderInt("Step", &timeline_step, 0, recorded_steps)) {
+                timeline_step = clamp(timeline_step, 0, recorded_steps);
+                auto_flow = false;
+                supervisor.stop_flow();
+                supervisor.flow_to_step(timeline_step);
+              }
+              timeline_active = ImGui::IsItemActive();
+              ImGui::SameLine();
+              help_marker("Drag to move through the recorded steps of the flow.");
+            }
+
+            static bool spanning_from_both_ends {false};
+            if (ImGui::Button("Test spanning")) {
+              supervisor.percolates(spanning_from_both_ends);
+            }
+            ImGui::SameLine();
+            ImGui::Checkbox("From both ends", &spanning_from_both_ends);
+            ImGui::SameLine();
+            help_marker("Check whether an open path joins the top to the bottom (or, on a torus, "
+                        "wraps around vertically), without flowing through the whole lattice.");
+            auto spanning {supervisor.get_spanning_result()};
+            if (spanning != std::nullopt) {
+              ImGui::Text(spanning->percolates ? "Spans (searched %zu sites)"
+                                               : "Doesn't span (searched %zu sites)",
+                          spanning->sites_touched);
+            }
           } else if (percolation_mode == PercolationMode::clusters) {
             if (auto_find_clusters or supervisor.done_percolation()) {
               begin_disable_items();
@@ -676,14 +829,23 @@ int main(int, char**) {
                   ImGui::Text("Size"); ImGui::NextColumn();
                   ImGui::Text("Count"); ImGui::NextColumn();
                   ImGui::Separator();
-                  // TODO Why is this so slow?
-                  auto cluster_sizes {supervisor.get_cluster_sizes()};
-                  if (cluster_sizes != std::nullopt) {
-                    for (auto [sz, ct] : cluster_sizes.value()) {
-                      ImGui::Text("%-8d", sz);
-                      ImGui::NextColumn();
-                      ImGui::Text("%-8d", ct);
-                      ImGui::NextColumn();
+                  // Only fetch the histogram when a new version is available.
+                  if (!cluster_sizes ||
+                      cluster_sizes->version != supervisor.cluster_sizes_version()) {
+                    cluster_sizes = supervisor.get_cluster_sizes();
+                  }
+                  if (cluster_sizes) {
+                    // Only lay out the rows that are visible.
+                    ImGuiListClipper clipper;
+                    clipper.Begin(cluster_sizes->entries.size());
+                    while (clipper.Step()) {
+                      for (int row {clipper.DisplayStart}; row < clipper.DisplayEnd; ++row) {
+                        const auto [sz, ct] {cluster_sizes->entries[row]};
+                        ImGui::Text("%-8d", sz);
+                        ImGui::NextColumn();
+                        ImGui::Text("%-8d", ct);
+                        ImGui::NextColumn();
+                      }
                     }
                   }
                   ImGui::EndChild();
@@ -694,6 +856,114 @@ int main(int, char**) {
             }
           }
         }  // Percolation controls
+
+        if (ImGui::CollapsingHeader("Batch")) {
+          // Runs many independent samples of the current lattice size and measure, and gathers
+          // statistics over them.
+          static int num_samples {100};
+          static bool batch_spanning {true};
+          static bool batch_clusters {false};
+          static float sample_budget {0.0F};
+          static uint64_t batch_first_seed {0};
+          struct BatchStatistics {
+            std::size_t num_complete {0};
+            std::size_t num_spanning {0};
+            std::size_t num_with_clusters {0};
+            double total_largest_cluster_size {0.0};
+          };
+          static BatchStatistics statistics;
+          static std::optional<SampleResult> last_result;
+
+          const bool batch_running {ensemble && !ensemble->done()};
+          if (batch_running) {
+            begin_disable_items();
+          }
+          ImGui::InputInt("Samples", &num_samples);
+          num_samples = std::max(1, num_samples);
+          ImGui::InputScalar("First seed", ImGuiDataType_U64, &batch_first_seed, nullptr, nullptr,
+                             "%llu");
+          ImGui::SameLine();
+          help_marker("Sample number i is filled with seed (first seed + i), using the random "
+                      "engine chosen under Measure, so that any sample can be reproduced by "
+                      "entering its seed there. The exception: jobs that only test spanning, on "
+                      "a lattice of at most 256 x 256 that isn't a torus, with a Bernoulli "
+                      "measure, are filled 64 samples at a time, each batch from one seed, by a "
+                      "faster method. Such a sample is shown as a lane of its batch's seed, and "
+                      "can't be reproduced under Measure.");
+          ImGui::Checkbox("Test spanning###batch_spanning", &batch_spanning);
+          ImGui::SameLine();
+          ImGui::Checkbox("Find clusters###batch_clusters", &batch_clusters);
+          ImGui::SliderFloat("Time per sample", &sample_budget, 0.0F, 10.0F,
+                             sample_budget == 0.0F ? "unlimited" : "%.2f s");
+          ImGui::SameLine();
+          help_marker("Samples that take longer than this are abandoned, and counted as "
+                      "incomplete.");
+          if (batch_running) {
+            end_disable_items();
+          }
+
+          if (batch_running) {
+            if (ImGui::Button("Cancel###batch_run")) {
+              ensemble->cancel();
+            }
+          } else if (ImGui::Button("Run###batch_run")) {
+            ensemble.reset();  // Finish with the old one first.
+            EnsembleJob job;
+            job.width = lattice_size;
+            job.height = lattice_size;
+            job.measure = make_measure(gui_measure, bernoulli_p, bernoulli_precision);
+            job.torus = torus;
+            job.first_seed = batch_first_seed;
+            job.engine = random_engine;
+            job.num_samples = num_samples;
+            job.test_spanning = batch_spanning;
+            job.find_clusters = batch_clusters;
+            job.time_budget = sample_budget;
+            statistics = {};
+            last_result.reset();
+            ensemble = std::make_unique<Ensemble>(job);
+          }
+
+          if (ensemble) {
+            SampleResult result;
+            while (ensemble->pop_result(result)) {
+              last_result = result;
+              if (!result.complete) {
+                continue;
+              }
+              ++statistics.num_complete;
+              if (result.spanning && result.spanning->percolates) {
+                ++statistics.num_spanning;
+              }
+              if (batch_clusters) {
+                ++statistics.num_with_clusters;
+                statistics.total_largest_cluster_size += result.largest_cluster_size;
+              }
+            }
+            ImGui::SameLine();
+            progress_bar(ensemble->report());
+            ImGui::Text("%zu samples done (%.1f per second), %zu complete",
+                        ensemble->num_samples_done(), ensemble->samples_per_second(),
+                        statistics.num_complete);
+            if (last_result && last_result->lane) {
+              ImGui::Text("Last sample: lane %u of the batch with seed %llu, %s",
+                          *last_result->lane, static_cast<unsigned long long>(last_result->seed),
+                          random_engine_name(last_result->engine));
+            } else if (last_result) {
+              ImGui::Text("Last sample: seed %llu, %s",
+                          static_cast<unsigned long long>(last_result->seed),
+                          random_engine_name(last_result->engine));
+            }
+            if (statistics.num_complete > 0 && batch_spanning) {
+              ImGui::Text("Spanning: %.1f%%",
+                          100.0 * statistics.num_spanning / statistics.num_complete);
+            }
+            if (statistics.num_with_clusters > 0) {
+              ImGui::Text("Mean largest cluster: %.1f sites",
+                          statistics.total_largest_cluster_size / statistics.num_with_clusters);
+            }
+          }
+        }  // Batch controls
             
         ImGui::EndChild();
 
@@ -714,6 +984,11 @@ int main(int, char**) {
             }
             ImGui::SameLine();
             ImGui::Text("%s...", busy_string.value().c_str());
+            const auto progress {supervisor.busy_progress()};
+            if (progress != std::nullopt) {
+              ImGui::SameLine();
+              progress_bar(progress.value());
+            }
           }
         } else {
           stopwatch.stop();
@@ -732,6 +1007,68 @@ int main(int, char**) {
         ImGui::SameLine(); ImGui::Checkbox("Demo Window", &demo_window_visible);
         ImGui::Text("GUI framerate: %.3f ms/frame (%.1f FPS)",
                     1000.0F / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+        ImGui::Text("Bernoulli fill: %s",
+                    BernoulliStream::simd_level_name(BernoulliStream::best_simd_level()));
+        if (const auto placement {supervisor.get_grid_placement()}) {
+          ImGui::Text("Grid memory: %s", placement->describe().c_str());
+        }
+        {
+          // At p_c, on lattices whose rows grow well past the L2 cache. Takes a while; the GUI
+          // stays responsive.
+          if (benchmark_task.valid() &&
+              benchmark_task.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            benchmarks = benchmark_task.get();
+          }
+          if (benchmark_task.valid()) {
+            ImGui::Text("Benchmarking layouts...");
+          } else if (ImGui::Button("Benchmark layouts")) {
+            benchmark_task = std::async(
+              std::launch::async,
+              [p = rect_site_percolation_threshold, &benchmark_running]() {
+                const std::array<std::pair<unsigned int, unsigned int>, 4> sizes {
+                  {{1024, 1024}, {4096, 4096}, {1 << 16, 256}, {1 << 18, 256}}};
+                std::vector<LayoutBenchmark> results;
+                for (const auto &[width, height] : sizes) {
+                  if (!benchmark_running) {
+                    break;
+                  }
+                  if (auto result {benchmark_layouts(width, height, p, 1, benchmark_running)}) {
+                    results.push_back(*result);
+                  }
+                }
+                return results;
+              });
+          }
+          for (const auto &b : benchmarks) {
+            ImGui::Text("%ux%u: flow %.0f / %.0f ms, clusters %.0f / %.0f ms (row-major / tiled)%s",
+                        b.width, b.height, b.row_major_flow_ms, b.tiled_flow_ms,
+                        b.row_major_clusters_ms, b.tiled_clusters_ms,
+                        b.agree ? "" : " MISMATCH");
+          }
+        }
+        {
+          // Forces the parallel flow kernel on a torus, where it reads ghosts while other threads
+          // flood their neighbors. Small enough to run between frames.
+          static std::optional<bool> parallel_flow_agrees;
+          if (ImGui::Button("Check parallel flow")) {
+            std::atomic_bool run {true};
+            parallel_flow_agrees = Lattice::check_parallel_flow(
+              4096, 256, rect_site_percolation_threshold, 1, run);
+          }
+          if (parallel_flow_agrees) {
+            ImGui::SameLine();
+            ImGui::Text(*parallel_flow_agrees ? "Parallel flow agrees" : "Parallel flow MISMATCH");
+          }
+          // With strengths of 4 bits, nearly every pop is a tie.
+          static std::optional<bool> invasion_ties_agree;
+          if (ImGui::Button("Check invasion ties")) {
+            invasion_ties_agree = check_strength_queue_ties(1, 4);
+          }
+          if (invasion_ties_agree) {
+            ImGui::SameLine();
+            ImGui::Text(*invasion_ties_agree ? "Ties newest first" : "Invasion ties MISMATCH");
+          }
+        }
 #endif
       }
       ImGui::End();
@@ -770,6 +1107,14 @@ int main(int, char**) {
     glfwSwapBuffers(window);
   }  // Main loop
 
+#ifdef DEVEL_FEATURES
+  benchmark_running = false;
+  if (benchmark_task.valid()) {
+    benchmark_task.wait();
+  }
+  cluster_sizes.reset();
+#endif
+  ensemble.reset();  // Cancels the batch, and waits only for the samples in progress.
   cleanup_gui(window);
 
   return 0;
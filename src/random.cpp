@@ -0,0 +1,159 @@
+#include "random.h"
+
+
+// 64 x 64 -> 128 bit multiplication, as (low, high).
+static inline void multiply_wide(uint64_t a, uint64_t b, uint64_t &low, uint64_t &high) {
+#ifdef __SIZEOF_INT128__
+  // __extension__, or -Wpedantic complains that __int128 isn't standard.
+  __extension__ using uint128 = unsigned __int128;
+  const uint128 product {static_cast<uint128>(a) * b};
+  low = static_cast<uint64_t>(product);
+  high = static_cast<uint64_t>(product >> 64);
+#else
+  const uint64_t a_low {a & 0xFFFFFFFF}, a_high {a >> 32};
+  const uint64_t b_low {b & 0xFFFFFFFF}, b_high {b >> 32};
+  const uint64_t low_low {a_low * b_low};
+  const uint64_t high_low {a_high * b_low};
+  const uint64_t low_high {a_low * b_high};
+  const uint64_t middle {(low_low >> 32) + (high_low & 0xFFFFFFFF) + low_high};
+  low = (middle << 32) | (low_low & 0xFFFFFFFF);
+  high = a_high * b_high + (high_low >> 32) + (middle >> 32);
+#endif
+}
+
+RandomStream::RandomStream(uint64_t seed, uint64_t stream, RandomEngine random_engine)
+  : engine {random_engine}
+  , state {}
+  , key {seed}
+  , philox_output {}
+{
+  uint64_t x {splitmix64(seed + splitmix64(stream))};
+  switch (engine) {
+  case RandomEngine::xorshift:
+    state[0] = x == 0 ? 1 : x;  // Must be nonzero.
+    break;
+  case RandomEngine::pcg:
+    state[0] = x;
+    state[1] = splitmix64(x);
+    // The increment picks one of 2^127 sequences, and must be odd.
+    state[2] = splitmix64(stream) | 1;
+    state[3] = splitmix64(state[1]);
+    break;
+  case RandomEngine::philox:
+    state[0] = 0;
+    state[1] = stream;
+    break;
+  default:
+    for (auto &word : state) {
+      x = splitmix64(x);
+      word = x == 0 ? 1 : x;  // Mustn't all be zero.
+    }
+    break;
+  }
+}
+
+// PCG64 DXSM, as in NumPy: a 128-bit LCG with a 64-bit multiplier, whose output is the high half
+// of the old state, scrambled by "double xorshift multiply".
+uint64_t RandomStream::next_pcg() {
+  constexpr uint64_t multiplier {0xDA942042E4DD58B5ULL};
+  uint64_t hi {state[1]};
+  const uint64_t lo {state[0] | 1};
+  // state = state * multiplier + increment (mod 2^128)
+  uint64_t low, high;
+  multiply_wide(state[0], multiplier, low, high);
+  high += state[1] * multiplier;
+  low += state[2];
+  high += state[3] + (low < state[2]);
+  state[0] = low;
+  state[1] = high;
+
+  hi ^= hi >> 32;
+  hi *= multiplier;
+  hi ^= hi >> 48;
+  hi *= lo;
+  return hi;
+}
+
+// Philox4x32-10: ten rounds of multiplications and xors on a 128-bit counter, with a 64-bit key.
+// The counter is (index, stream), and each block of output gives two numbers. The rounds are one
+// long chain of multiplications, so several blocks are made side by side to overlap them.
+template <std::size_t num_blocks>
+static inline void philox_blocks(uint64_t first_index, uint64_t stream, uint64_t key,
+                                 uint64_t* out) {
+  constexpr uint32_t m0 {0xD2511F53}, m1 {0xCD9E8D57};
+  constexpr uint32_t w0 {0x9E3779B9}, w1 {0xBB67AE85};
+  uint32_t c[4][num_blocks];
+  for (std::size_t b {0}; b < num_blocks; ++b) {
+    c[0][b] = static_cast<uint32_t>(first_index + b);
+    c[1][b] = static_cast<uint32_t>((first_index + b) >> 32);
+    c[2][b] = static_cast<uint32_t>(stream);
+    c[3][b] = static_cast<uint32_t>(stream >> 32);
+  }
+  uint32_t k0 {static_cast<uint32_t>(key)}, k1 {static_cast<uint32_t>(key >> 32)};
+  for (int round {0}; round < 10; ++round) {
+    for (std::size_t b {0}; b < num_blocks; ++b) {
+      const uint64_t p0 {static_cast<uint64_t>(m0) * c[0][b]};
+      const uint64_t p1 {static_cast<uint64_t>(m1) * c[2][b]};
+      c[0][b] = static_cast<uint32_t>(p1 >> 32) ^ c[1][b] ^ k0;
+      c[1][b] = static_cast<uint32_t>(p1);
+      c[2][b] = static_cast<uint32_t>(p0 >> 32) ^ c[3][b] ^ k1;
+      c[3][b] = static_cast<uint32_t>(p0);
+    }
+    k0 += w0;
+    k1 += w1;
+  }
+  for (std::size_t b {0}; b < num_blocks; ++b) {
+    out[2 * b] = (static_cast<uint64_t>(c[1][b]) << 32) | c[0][b];
+    out[2 * b + 1] = (static_cast<uint64_t>(c[3][b]) << 32) | c[2][b];
+  }
+}
+
+uint64_t RandomStream::next_philox() {
+  if (philox_output_ready) {
+    philox_output_ready = false;
+    return philox_output[1];
+  }
+  philox_blocks<1>(state[0]++, state[1], key, philox_output);
+  philox_output_ready = true;
+  return philox_output[0];
+}
+
+// The same as calling next() n times, but only chooses the engine once.
+void RandomStream::generate(uint64_t* out, std::size_t n) {
+  switch (engine) {
+  case RandomEngine::xorshift:
+    for (std::size_t i {0}; i < n; ++i) {
+      out[i] = next_xorshift();
+    }
+    break;
+  case RandomEngine::pcg:
+    for (std::size_t i {0}; i < n; ++i) {
+      out[i] = next_pcg();
+    }
+    break;
+  case RandomEngine::philox: {
+    std::size_t i {0};
+    if (philox_output_ready && n > 0) {
+      out[i++] = next_philox();
+    }
+    // Whole blocks, straight into out.
+    constexpr std::size_t blocks_at_once {4};
+    for (; i + 2 * blocks_at_once <= n; i += 2 * blocks_at_once) {
+      philox_blocks<blocks_at_once>(state[0], state[1], key, out + i);
+      state[0] += blocks_at_once;
+    }
+    for (; i + 2 <= n; i += 2) {
+      philox_blocks<1>(state[0]++, state[1], key, out + i);
+    }
+    if (i < n) {
+      out[i] = next_philox();
+    }
+    break;
+  }
+  default:
+    for (std::size_t i {0}; i < n; ++i) {
+      out[i] = next_xoshiro();
+    }
+    break;
+  }
+}
@@ -0,0 +1,104 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstddef>
+#include <cstdint>
+
+
+// The pseudorandom number generators that lattices can be filled with, from fastest to best.
+// Make sure to keep RandomEngine and random_engine_names in the same order.
+enum class RandomEngine : int {xorshift, xoshiro, pcg, philox, MAX};
+inline constexpr const char* random_engine_names[]
+  {"xorshift64*", "xoshiro256++", "PCG64 DXSM", "Philox4x32-10"};
+inline constexpr RandomEngine default_random_engine {RandomEngine::xoshiro};
+
+inline const char* random_engine_name(RandomEngine engine) {
+  return random_engine_names[static_cast<int>(engine)];
+}
+
+// A pseudorandom number generator that can be split into independent streams: each (seed, stream)
+// pair gives its own sequence. The engine is chosen at run time:
+//
+// - xorshift64*: the fastest, and good enough for most pictures. See
+//   <https://en.wikipedia.org/wiki/Xorshift>.
+// - xoshiro256++: nearly as fast, and passes all the usual statistical tests. See
+//   <https://prng.di.unimi.it/>.
+// - PCG64 DXSM: a 128-bit linear congruential generator with a scrambled output, as in NumPy. See
+//   <https://www.pcg-random.org/>.
+// - Philox4x32-10: counter based, so each number is a hash of (seed, stream, index), and no state
+//   carries over from one to the next. The slowest, but the most trusted. See Salmon et al.,
+//   "Parallel random numbers: as easy as 1, 2, 3" (2011).
+//
+// The first three are seeded by scrambling (seed, stream) with splitmix64.
+class RandomStream {
+public:
+  RandomStream(uint64_t seed, uint64_t stream, RandomEngine engine = default_random_engine);
+
+  uint64_t next() {
+    switch (engine) {
+    case RandomEngine::xorshift:
+      return next_xorshift();
+    case RandomEngine::pcg:
+      return next_pcg();
+    case RandomEngine::philox:
+      return next_philox();
+    default:
+      return next_xoshiro();
+    }
+  }
+  uint32_t next32() {
+    return next() >> 32;  // The high bits are the best ones.
+  }
+  void generate(uint64_t* out, std::size_t n);
+
+  RandomEngine get_engine() const {
+    return engine;
+  }
+
+  static uint64_t splitmix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+  }
+
+private:
+  static uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+  }
+
+  uint64_t next_xorshift() {
+    uint64_t &x {state[0]};
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    return x * 0x2545F4914F6CDD1DULL;
+  }
+
+  uint64_t next_xoshiro() {
+    uint64_t (&s)[4] {state};
+    const uint64_t result {rotl(s[0] + s[3], 23) + s[0]};
+    const uint64_t t {s[1] << 17};
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+  }
+
+  uint64_t next_pcg();
+  uint64_t next_philox();
+
+  RandomEngine engine;
+  // xorshift64* uses word 0; xoshiro256++ all four; PCG64 holds its state (low, high) and
+  // increment (low, high); Philox holds its counter (index, stream) and key (seed).
+  uint64_t state[4];
+  uint64_t key;
+  uint64_t philox_output[2];  // Philox makes two numbers at a time
+  bool philox_output_ready {false};
+};
+
+
+#endif  // RANDOM_H
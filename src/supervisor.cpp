@@ -2,10 +2,12 @@
 #include <cassert>
 #include <condition_variable>
 #include <future>
-#include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <queue>
+#include <random>
+#include <span>
 #include <string>
 #include <thread>
 
@@ -17,6 +19,7 @@ Supervisor::Supervisor(unsigned int width, unsigned int height, measure::filler
   : lattice_width {width}
   , lattice_height {height}
   , lattice_measure {f}
+  , next_seed {std::random_device{}()}
   , flow_direction {FlowDirection::top}
   , worker_thread {&Supervisor::worker, this} { }
 
@@ -33,6 +36,12 @@ Supervisor::~Supervisor() {
   lattice_mutex.lock();
   delete lattice;
   lattice_mutex.unlock();
+
+  running_prefill = false;
+  if (prefill_task.valid()) {
+    prefill_task.wait();
+  }
+  delete prefilled;
 }
 
 // Sets the size of the lattice. Note that fill() must be called subsequently to actually create
@@ -47,10 +56,40 @@ void Supervisor::set_size(unsigned int width, unsigned int height) {
 // Sets a new measure (but does not fill the lattice).
 void Supervisor::set_measure(measure::filler f) {
   lattice_measure_mutex.lock();
-  lattice_measure = f;
+  if (!(f == lattice_measure)) {
+    lattice_measure = f;
+    ++measure_version;  // Only if it's really new, so that a prefill for the old one still counts
+  }
   lattice_measure_mutex.unlock();
 }
 
+// Sets the seed for the next fill. Each fill after that uses the next seed in sequence, so a run of
+// lattices can be reproduced by starting from the same seed.
+void Supervisor::set_seed(uint64_t seed) {
+  next_seed = seed;
+}
+
+// Returns the seed that the current lattice was filled with.
+uint64_t Supervisor::get_seed() {
+  return lattice_seed;
+}
+
+// Sets the pseudorandom number generator for the next fill and all the fills after it.
+void Supervisor::set_random_engine(RandomEngine engine) {
+  next_engine = engine;
+}
+
+// Returns the pseudorandom number generator that the current lattice was filled with.
+RandomEngine Supervisor::get_random_engine() {
+  return lattice_engine;
+}
+
+// In pipelined mode, each fill also starts filling the next lattice in the background, so that the
+// fill after it is (nearly) instant. This takes twice the memory.
+void Supervisor::set_pipelined(bool is_pipelined) {
+  pipelined = is_pipelined;
+}
+
 // Replaces the lattice by a new one, randomly filled.
 void Supervisor::fill() {
   request_mutex.lock();
@@ -60,7 +99,9 @@ void Supervisor::fill() {
   fill_requested = true;
   flow_fully_requested = false;
   flow_steps_requested = 0;
+  flow_to_step_requested = false;
   find_clusters_requested = false;
+  running_copy = false;  // A copy of the old lattice is useless now.
   request_mutex.unlock();
 }
 
@@ -75,6 +116,12 @@ void Supervisor::abort_stale_operations() {
     // Start over percolation immediately.
     running_percolation = false;
   }
+  if (running_copy && (fill_requested || flow_fully_requested || find_clusters_requested)) {
+    running_copy = false;
+  }
+  if (running_spanning && (fill_requested || percolates_requested)) {
+    running_spanning = false;
+  }
   request_mutex.unlock();
 }
 
@@ -82,8 +129,23 @@ void Supervisor::set_flow_direction(FlowDirection direction) {
   flow_direction = direction;
 }
 
+// Reset the percolation after changing the model (or trapping): a flow can't switch models midway.
+void Supervisor::set_flow_model(FlowModel model) {
+  flow_model = model;
+}
+
+void Supervisor::set_trapping(bool is_trapping) {
+  trapping = is_trapping;
+}
+
 void Supervisor::set_torus(bool is_torus) {
   torus = is_torus;
+  // The question has changed, so any answer to the old one is stale. Don't wait for a search in
+  // progress (which holds spanning_result_mutex) to find out: just stop it.
+  ++spanning_question;
+  request_mutex.lock();
+  running_spanning = false;
+  request_mutex.unlock();
 }
 
 void Supervisor::flood_entryways() {
@@ -102,6 +164,7 @@ void Supervisor::flow_fully() {
   request_mutex.lock();
   flow_fully_requested = true;
   find_clusters_requested = false;
+  running_copy = false;
   request_mutex.unlock();
 }
 
@@ -152,10 +215,35 @@ bool Supervisor::is_flowing() {
   return flowing;
 }
 
+// Whether to record the flood-time map during flow, for use with flow_to_step(). This takes
+// effect when the next flow begins.
+void Supervisor::set_record_flood_times(bool record) {
+  record_flood_times = record;
+}
+
+// Jumps to the given step of a recorded flow, forward or backward.
+void Supervisor::flow_to_step(unsigned int step) {
+  request_mutex.lock();
+  flow_steps_requested = 0;
+  requested_flow_step = step;
+  flow_to_step_requested = true;
+  request_mutex.unlock();
+}
+
+unsigned int Supervisor::num_flow_steps() {
+  return flow_step_count;
+}
+
+// The number of steps available to flow_to_step().
+unsigned int Supervisor::num_recorded_flow_steps() {
+  return recorded_flow_step_count;
+}
+
 void Supervisor::find_clusters() {
   request_mutex.lock();
   find_clusters_requested = true;
   flow_fully_requested = false;
+  running_copy = false;
   request_mutex.unlock();
 }
 
@@ -183,21 +271,23 @@ void Supervisor::reset_percolation() {
   find_clusters_requested = false;
   flow_fully_requested = false;
   flow_steps_requested = 0;
+  flow_to_step_requested = false;
   reset_requested = true;
   request_mutex.unlock();
 }
 
-// Returns the cluster sizes, unless they're busy being computed.
-// TODO Return a saner data structure, e.g., a sorted vector of pairs.
-auto Supervisor::get_cluster_sizes()
-      -> std::optional<std::map<const unsigned int, unsigned int, ReverseCmp>> {
-  std::unique_lock<std::mutex> lock(cluster_sizes_mutex, std::try_to_lock);
-  if (!lock.owns_lock()) {
-    return std::nullopt;
-  }
+// Returns the latest cluster sizes, or nullptr if none have been computed yet. This is cheap: the
+// histogram is shared, not copied. To avoid even that, compare its version with
+// cluster_sizes_version() before asking again.
+std::shared_ptr<const ClusterSizeHistogram> Supervisor::get_cluster_sizes() {
+  std::unique_lock<std::mutex> lock(cluster_sizes_mutex);
   return cluster_sizes;
 }
 
+unsigned int Supervisor::cluster_sizes_version() {
+  return cluster_sizes_latest_version;
+}
+
 float Supervisor::cluster_largest_proportion() {
   auto base {100.0F};
   // TODO How to properly detect the proportion of open sites, regardless of measure?
@@ -212,6 +302,25 @@ float Supervisor::cluster_largest_proportion() {
   return base * max_cluster_size / (lattice_width * lattice_height);
 }
 
+// Asks whether the lattice percolates (see Lattice::percolates()). The answer becomes available
+// from get_spanning_result() once it's known.
+void Supervisor::percolates(bool bidirectional) {
+  request_mutex.lock();
+  spanning_bidirectional = bidirectional;
+  percolates_requested = true;
+  request_mutex.unlock();
+}
+
+// Returns the answer to the last call to percolates(), unless it's busy being computed, or the
+// lattice has been refilled (or the question changed) since.
+std::optional<SpanningResult> Supervisor::get_spanning_result() {
+  std::unique_lock<std::mutex> lock(spanning_result_mutex, std::try_to_lock);
+  if (!lock.owns_lock() || spanning_result_question != spanning_question) {
+    return std::nullopt;
+  }
+  return spanning_result;
+}
+
 // If the lattice has changed since the last time this function was called, tries to return a
 // pointer to a copy of the lattice. If the lattice hasn't changed, returns nullptr.  If the
 // lattice is busy being copied, returns nullptr, unless this has been happening for at least
@@ -252,6 +361,21 @@ void Supervisor::request_copy() {
   request_mutex.unlock();
  }
 
+// Where the current lattice's memory is: how much is in huge pages, and on which NUMA nodes.
+// Nothing until the first fill. Finding out isn't cheap, so it's only done when asked, once per
+// fill; while the lattice is busy, the answer for an earlier fill is returned.
+std::optional<MemoryPlacement> Supervisor::get_grid_placement() {
+  std::unique_lock<std::mutex> lock {grid_placement_mutex};
+  if (grid_placement_fill != fill_count) {
+    std::unique_lock<std::mutex> lock_l(lattice_mutex, std::try_to_lock);
+    if (lock_l.owns_lock() && lattice) {
+      grid_placement = lattice->grid_placement();
+      grid_placement_fill = fill_count;
+    }
+  }
+  return grid_placement;
+}
+
 // Returns a string if a computation is currently in progress.
 std::optional<std::string> Supervisor::busy() {
   if (running_cluster_sizes) {
@@ -269,12 +393,33 @@ std::optional<std::string> Supervisor::busy() {
   if (running_reset) {
     return "Resetting lattice";
   }
+  if (running_spanning) {
+    return "Testing for a spanning path";
+  }
   if (running) {
     return "Computing";  // Generic busy message
   }
   return std::nullopt;
 }
 
+// Returns how far along the computation named by busy() is, if it reports its progress.
+std::optional<ProgressReport> Supervisor::busy_progress() {
+  if (running_cluster_sizes) {
+    return std::nullopt;
+  }
+  if (running_copy) {
+    return copy_progress.report();
+  }
+  if (running_fill) {
+    // The fill may be waiting for the prefill to finish.
+    return running_prefill ? prefill_progress.report() : fill_progress.report();
+  }
+  if (running_percolation) {
+    return percolation_progress.report();
+  }
+  return std::nullopt;
+}
+
 bool Supervisor::errors_exist() {
   return not errors.empty();
 }
@@ -293,20 +438,80 @@ void Supervisor::abort() {
 
   running = false;
   running_cluster_sizes = false;
-  //running_copy = false;  // There's no way to abort a copy yet.
+  running_copy = false;
   running_fill = false;
   running_percolation = false;
   running_reset = false;
+  running_spanning = false;
+  running_prefill = false;
 
   reset_requested = false;
   flood_entryways_requested = false;
   fill_requested = false;
   flow_fully_requested = false;
+  flow_to_step_requested = false;
   find_clusters_requested = false;
+  percolates_requested = false;
 
   request_mutex.unlock();
 }
 
+// Starts filling the lattice for the next fill in the background, reusing buffer if it's not
+// nullptr. There must be no prefill in progress.
+//
+// The prefill is one low-priority task on the shared pool. Within a task, parallel_for() runs on
+// that one worker, so the prefill takes a single core, and leaves the others to whatever is done
+// with the current lattice meanwhile. That's the overlap this is for.
+void Supervisor::start_prefill(Lattice* buffer, FillKey key, measure::filler f) {
+  assert(!prefill_task.valid());
+  running_prefill = true;
+  prefill_key = key;
+  auto done {std::make_shared<std::promise<void>>()};
+  prefill_task = done->get_future();
+  ThreadPool::shared().submit(
+    [this, buffer, key, f, done]() {
+      Lattice* next {buffer};
+      try {
+        if (!next) {
+          next = new Lattice(key.width, key.height);
+        } else if (next->get_width() != key.width || next->get_height() != key.height) {
+          next->resize(key.width, key.height);
+        }
+        next->fill(f, key.seed, prefill_progress, key.engine);
+        if (running_prefill) {
+          prefilled = next;
+        } else {
+          delete next;  // Aborted
+        }
+      } catch (std::bad_alloc& ba) {
+        delete next;  // Not worth reporting: the next fill will try again, and report it.
+      }
+      done->set_value();
+    }, TaskPriority::low);
+}
+
+// Returns the prefilled lattice if it's exactly what the fill described by key would make,
+// waiting for it to finish if necessary. Otherwise, or if the prefill gets aborted meanwhile,
+// discards it and returns nullptr. Must not be called with lattice_mutex held: the wait may be
+// long, and nothing else needs the lattice during it.
+Lattice* Supervisor::take_prefilled_lattice(FillKey key) {
+  if (!prefill_task.valid()) {
+    return nullptr;
+  }
+  if (!pipelined || prefill_key != key) {
+    running_prefill = false;  // Don't bother finishing it.
+  }
+  prefill_task.get();
+  running_prefill = false;
+  Lattice* next {prefilled};
+  prefilled = nullptr;
+  if (next && (!pipelined || prefill_key != key)) {
+    delete next;
+    next = nullptr;
+  }
+  return next;
+}
+
 void Supervisor::make_lattice_copy_if_needed() {
   request_mutex.lock();
   if (!lattice_copy_requested) {
@@ -314,40 +519,94 @@ void Supervisor::make_lattice_copy_if_needed() {
     return;
   }
   lattice_copy_requested = false;
+  // The copy is preempted (running_copy is made false) as soon as a newer fill or percolation
+  // request arrives. Setting the flag while holding request_mutex ensures no preemption is lost.
+  running_copy = true;
   request_mutex.unlock();
 
   lattice_copy_mutex.lock();
-  running_copy = true;
   delete lattice_copy;
+  lattice_copy = nullptr;
   lattice_mutex.lock();
-  // TODO Allow abort in the middle of a copy operation, if running_copy is made false.
   if (lattice) {
-    lattice_copy = new Lattice(*lattice);
-  } else {
-    lattice_copy = nullptr;
+    lattice_copy = new Lattice(*lattice, copy_progress);
+    if (!running_copy) {
+      // Aborted. The GUI will ask again, since changed_since_copy remains true.
+      delete lattice_copy;
+      lattice_copy = nullptr;
+    }
+  }
+  if (running_copy) {
+    changed_since_copy = false;
   }
-  changed_since_copy = false;
   lattice_mutex.unlock();
   running_copy = false;
   lattice_copy_mutex.unlock();
 }
 
+// Run-length encodes the lattice's cluster size counts, largest size first, and publishes the
+// result as a new version of the histogram. The sizes are split into chunks, and each chunk
+// first counts, then writes, its own entries, so that the chunks can be done in parallel.
 void Supervisor::compute_cluster_sizes() {
-  std::unique_lock<std::mutex> lock_cs(cluster_sizes_mutex);
-  cluster_sizes.clear();
-  max_cluster_size = 0;
-  auto f {
-    [&] (Cluster cluster) {
-      size_t size {cluster.size()};
-      cluster_sizes[size] += 1;
-      max_cluster_size = std::max(size, max_cluster_size.load());
-    }};
   std::unique_lock<std::mutex> lock_l(lattice_mutex);
   running_cluster_sizes = true;
-  lattice->for_each_cluster(f, std::ref(running_cluster_sizes));
+  const std::span<const unsigned int> counts {lattice->cluster_size_counts()};
+  const std::size_t num_sizes {counts.size()};
+  constexpr std::size_t chunk_size {1 << 14};
+  const std::size_t num_chunks {(num_sizes + chunk_size - 1) / chunk_size};
+  // Chunk k covers the sizes in [num_sizes - end, num_sizes - begin), in descending order.
+  auto for_each_size_in_chunk {
+    [&](std::size_t begin, std::size_t end, auto f) {
+      for (std::size_t j {begin}; j < end; ++j) {
+        const std::size_t size {num_sizes - 1 - j};
+        if (counts[size] != 0) {
+          f(size);
+        }
+      }
+    }};
+
+  std::vector<std::size_t> chunk_offsets(num_chunks + 1, 0);
+  parallel_for_chunks(
+    num_sizes, chunk_size,
+    [&](std::size_t begin, std::size_t end) {
+      std::size_t n {0};
+      for_each_size_in_chunk(begin, end, [&](std::size_t) { ++n; });
+      chunk_offsets[begin / chunk_size + 1] = n;
+    }, running_cluster_sizes);
+  for (std::size_t k {0}; k < num_chunks; ++k) {
+    chunk_offsets[k + 1] += chunk_offsets[k];
+  }
+
+  auto histogram {std::make_shared<ClusterSizeHistogram>()};
+  histogram->entries.resize(chunk_offsets.back());
+  parallel_for_chunks(
+    num_sizes, chunk_size,
+    [&](std::size_t begin, std::size_t end) {
+      auto entry {histogram->entries.begin() + chunk_offsets[begin / chunk_size]};
+      for_each_size_in_chunk(
+        begin, end,
+        [&](std::size_t size) {
+          *entry++ = {static_cast<unsigned int>(size), counts[size]};
+        });
+    }, running_cluster_sizes);
+  lock_l.unlock();
+
+  if (running_cluster_sizes) {  // Unless aborted
+    max_cluster_size = histogram->entries.empty() ? 0 : histogram->entries.front().size;
+    std::unique_lock<std::mutex> lock_cs(cluster_sizes_mutex);
+    histogram->version = cluster_sizes_latest_version + 1;
+    cluster_sizes = std::move(histogram);
+    cluster_sizes_latest_version = cluster_sizes->version;
+  }
   running_cluster_sizes = false;
 }
 
+// Must be called with lattice_mutex held.
+void Supervisor::update_flow_step_counts() {
+  flow_step_count = lattice->num_flow_steps();
+  recorded_flow_step_count = lattice->num_recorded_flow_steps();
+}
+
 void Supervisor::worker() {
   bool skip_copy {false};
   lattice_mutex.lock();
@@ -372,6 +631,10 @@ void Supervisor::worker() {
       lattice->reset_percolation();
       lattice->set_flow_direction(flow_direction);
       lattice->set_torus(torus);
+      lattice->set_record_flood_times(record_flood_times);
+      lattice->set_flow_model(flow_model);
+      lattice->set_trapping(trapping);
+      update_flow_step_counts();
       changed_since_copy = true;
       lattice_mutex.unlock();
 
@@ -393,7 +656,11 @@ void Supervisor::worker() {
       running = true;
       lattice->set_flow_direction(flow_direction);
       lattice->set_torus(torus);
-      lattice->flood_entryways();
+      lattice->set_record_flood_times(record_flood_times);
+      lattice->set_flow_model(flow_model);
+      lattice->set_trapping(trapping);
+      lattice->flood_entryways(std::ref(running));
+      update_flow_step_counts();
       changed_since_copy = true;
       lattice_mutex.unlock();
       running = false;
@@ -406,10 +673,22 @@ void Supervisor::worker() {
       auto h {lattice_height};
       size_mutex.unlock();
 
+      lattice_measure_mutex.lock();
+      auto lm {lattice_measure};
+      const unsigned int mv {measure_version};
+      lattice_measure_mutex.unlock();
+      const uint64_t seed {next_seed++};
+      const RandomEngine engine {next_engine};
+
       bool bad_alloc {false};
-      lattice_mutex.lock();
       running_fill = true;
-      if (!lattice || lattice->get_width() != w || lattice->get_height() != h) {
+      Lattice* next {take_prefilled_lattice({w, h, mv, seed, engine})};
+      lattice_mutex.lock();
+      Lattice* spare {nullptr};  // To be recycled for the next prefill
+      if (next) {
+        spare = lattice;
+        lattice = next;
+      } else if (!lattice || lattice->get_width() != w || lattice->get_height() != h) {
         delete lattice;
         try {
           lattice = new Lattice(w, h);
@@ -424,12 +703,26 @@ void Supervisor::worker() {
       }
       lattice->set_flow_direction(flow_direction);
       lattice->set_torus(torus);
-      lattice_measure_mutex.lock();
-      auto lm {lattice_measure};
-      lattice_measure_mutex.unlock();
-      lattice->fill(lm, std::ref(running_fill));
+      lattice->set_record_flood_times(record_flood_times);
+      lattice->set_flow_model(flow_model);
+      lattice->set_trapping(trapping);
+      if (!spare) {
+        lattice->fill(lm, seed, fill_progress, engine);
+      }
+      lattice_seed = seed;
+      lattice_engine = engine;
+      ++fill_count;
+      update_flow_step_counts();
       changed_since_copy = true;
       lattice_mutex.unlock();
+      if (pipelined && !bad_alloc) {
+        start_prefill(spare, {w, h, mv, next_seed, engine}, lm);
+      } else {
+        delete spare;
+      }
+      spanning_result_mutex.lock();
+      spanning_result = std::nullopt;
+      spanning_result_mutex.unlock();
 
       request_mutex.lock();
       if (!running_fill) {
@@ -451,7 +744,11 @@ void Supervisor::worker() {
       changed_since_copy = true;
       lattice->set_flow_direction(flow_direction);
       lattice->set_torus(torus);
-      lattice->flow_fully(std::ref(running_percolation));
+      lattice->set_record_flood_times(record_flood_times);
+      lattice->set_flow_model(flow_model);
+      lattice->set_trapping(trapping);
+      lattice->flow_fully(percolation_progress);
+      update_flow_step_counts();
       lattice_mutex.unlock();
       if (!running_percolation) {
         skip_copy = true;  // Operation was aborted.
@@ -465,9 +762,14 @@ void Supervisor::worker() {
       changed_since_copy = true;
       lattice->set_flow_direction(flow_direction);
       lattice->set_torus(torus);
-      lattice->find_clusters(std::ref(running_percolation));
+      lattice->set_record_flood_times(record_flood_times);
+      lattice->set_flow_model(flow_model);
+      lattice->set_trapping(trapping);
+      lattice->find_clusters(percolation_progress);
+      update_flow_step_counts();
       if (running_percolation) {
-        lattice->sort_clusters();
+        // Only the largest clusters need to be told apart (e.g., by color).
+        lattice->sort_largest_clusters();
       }
       lattice_mutex.unlock();
       if (running_percolation) {  // Unless aborted
@@ -477,6 +779,32 @@ void Supervisor::worker() {
         skip_copy = true;
       }
       running_percolation = false;
+    } else if (percolates_requested) {
+      percolates_requested = false;
+      const bool bidirectional {spanning_bidirectional};
+      request_mutex.unlock();
+      std::unique_lock<std::mutex> lock_sr(spanning_result_mutex);
+      std::unique_lock<std::mutex> lock_l(lattice_mutex);
+      running_spanning = true;
+      // Read before torus, so that an answer is never taken for a newer question than its own.
+      spanning_result_question = spanning_question;
+      lattice->set_torus(torus);
+      spanning_result = lattice->percolates(bidirectional, spanning_progress);
+      running_spanning = false;
+    } else if (flow_to_step_requested) {
+      flow_to_step_requested = false;
+      auto step {requested_flow_step.load()};
+      request_mutex.unlock();
+      lattice_mutex.lock();
+      running = true;
+      changed_since_copy = true;
+      lattice->seek_flow(step, std::ref(running));
+      update_flow_step_counts();
+      lattice_mutex.unlock();
+      if (!running) {
+        skip_copy = true;  // Operation was aborted.
+      }
+      running = false;
     } else if (flow_steps_requested > 0) {
       flow_steps_requested -= 1;
       request_mutex.unlock();
@@ -485,7 +813,11 @@ void Supervisor::worker() {
       changed_since_copy = true;
       lattice->set_flow_direction(flow_direction);
       lattice->set_torus(torus);
+      lattice->set_record_flood_times(record_flood_times);
+      lattice->set_flow_model(flow_model);
+      lattice->set_trapping(trapping);
       bool did_flow {lattice->flow_one_step(std::ref(running))};
+      update_flow_step_counts();
       lattice_mutex.unlock();
       if (!did_flow) {
         stop_flow();
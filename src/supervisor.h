@@ -3,7 +3,7 @@
 
 #include <condition_variable>
 #include <future>
-#include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <queue>
@@ -14,6 +14,17 @@
 #include "lattice.h"
 
 
+// How many clusters there are of each size, as (size, count) pairs in descending order of size,
+// omitting sizes that don't occur. It's never modified once published: a new version replaces it.
+struct ClusterSizeHistogram {
+  struct Entry {
+    unsigned int size;
+    unsigned int count;
+  };
+  unsigned int version;
+  std::vector<Entry> entries;
+};
+
 // Oversees a single lattice. All member functions (except possibly the constructor) return
 // immediately: any necessary computations proceed asynchronously.
 class Supervisor {
@@ -29,9 +40,16 @@ public:
 
   void set_size(unsigned int width, unsigned int height);
   void set_measure(measure::filler f);
+  void set_seed(uint64_t seed);
+  uint64_t get_seed();
+  void set_random_engine(RandomEngine engine);
+  RandomEngine get_random_engine();
+  void set_pipelined(bool is_pipelined);
   void fill();
   void abort_stale_operations();
   void set_flow_direction(FlowDirection direction);
+  void set_flow_model(FlowModel model);
+  void set_trapping(bool is_trapping);
   void set_torus(bool is_torus);
   void flood_entryways();
   void flow_n_steps(unsigned int n);
@@ -40,24 +58,46 @@ public:
   void stop_flow();
   void set_flow_speed(float steps_per_second);
   bool is_flowing();
+  void set_record_flood_times(bool record);
+  void flow_to_step(unsigned int step);
+  unsigned int num_flow_steps();
+  unsigned int num_recorded_flow_steps();
   void find_clusters();
   unsigned int num_clusters();
   bool done_percolation();
   void reset_percolation();
-  auto get_cluster_sizes()
-    -> std::optional<std::map<const unsigned int, unsigned int, ReverseCmp>>;
+  std::shared_ptr<const ClusterSizeHistogram> get_cluster_sizes();
+  unsigned int cluster_sizes_version();
   float cluster_largest_proportion();
+  void percolates(bool bidirectional = false);
+  std::optional<SpanningResult> get_spanning_result();
   Lattice* get_lattice_copy(double copy_timeout_ms = 100.0);
   void request_copy();
   std::optional<std::string> busy();
+  std::optional<ProgressReport> busy_progress();
+  std::optional<MemoryPlacement> get_grid_placement();
   bool errors_exist();
   void clear_one_error();
   const std::string get_first_error();
   void abort();
 
 private:
+  // What a lattice was filled with. A prefilled lattice is only used if it's exactly what the
+  // next fill would have made.
+  struct FillKey {
+    unsigned int width;
+    unsigned int height;
+    unsigned int measure_version;
+    uint64_t seed;
+    RandomEngine engine;
+    bool operator==(const FillKey&) const =default;
+  };
+
+  void start_prefill(Lattice* buffer, FillKey key, measure::filler f);
+  Lattice* take_prefilled_lattice(FillKey key);
   void make_lattice_copy_if_needed();
   void compute_cluster_sizes();
+  void update_flow_step_counts();
   void worker();
 
   Lattice* lattice {nullptr};
@@ -70,11 +110,38 @@ private:
   unsigned int lattice_height;
   measure::filler lattice_measure;
   std::mutex lattice_measure_mutex;
-  std::map<const unsigned int, unsigned int, ReverseCmp> cluster_sizes;
+  unsigned int measure_version {0};  // Guarded by lattice_measure_mutex
+  std::atomic_uint64_t next_seed;
+  std::atomic_uint64_t lattice_seed {0};
+  std::atomic<RandomEngine> next_engine {default_random_engine};
+  std::atomic<RandomEngine> lattice_engine {default_random_engine};
+  std::atomic_uint fill_count {0};  // Changed only with lattice_mutex held
+  std::optional<MemoryPlacement> grid_placement;  // Of the lattice as of fill grid_placement_fill
+  unsigned int grid_placement_fill {0};
+  std::mutex grid_placement_mutex;
+
+  // In pipelined mode, the next lattice is filled in the background while the current one is
+  // being worked on. Only the worker thread touches these (and the prefill task, while it runs).
+  // The prefill has its own run flag, running_prefill, which abort() clears too.
+  std::atomic_bool pipelined {false};
+  std::future<void> prefill_task;
+  FillKey prefill_key {};
+  Lattice* prefilled {nullptr};
+  std::shared_ptr<const ClusterSizeHistogram> cluster_sizes;
   std::mutex cluster_sizes_mutex;
+  std::atomic_uint cluster_sizes_latest_version {0};
   std::atomic_size_t max_cluster_size {0};
+  std::optional<SpanningResult> spanning_result;
+  unsigned int spanning_result_question {0};  // Guarded by spanning_result_mutex
+  std::mutex spanning_result_mutex;
+  std::atomic_uint spanning_question {0};  // Bumped whenever the question changes
   FlowDirection flow_direction;
+  std::atomic<FlowModel> flow_model {FlowModel::ordinary};
+  std::atomic_bool trapping {false};
   std::atomic_bool torus;
+  std::atomic_bool record_flood_times {false};
+  std::atomic_uint flow_step_count {0};
+  std::atomic_uint recorded_flow_step_count {0};
 
   std::atomic_bool flowing {false};
   std::mutex flowing_mutex;
@@ -88,6 +155,13 @@ private:
   std::atomic_bool running_fill {false};
   std::atomic_bool running_percolation {false};
   std::atomic_bool running_reset {false};
+  std::atomic_bool running_spanning {false};
+  Progress copy_progress {running_copy};
+  Progress fill_progress {running_fill};
+  Progress percolation_progress {running_percolation};
+  Progress spanning_progress {running_spanning};
+  std::atomic_bool running_prefill {false};
+  Progress prefill_progress {running_prefill};
   std::future<void> flow_thread;
   std::atomic_bool changed_since_copy {false};
 
@@ -101,7 +175,11 @@ private:
   std::atomic_bool fill_requested {false};
   std::atomic_bool flow_fully_requested {false};
   std::atomic_uint64_t flow_steps_requested {0};
+  std::atomic_bool flow_to_step_requested {false};
+  std::atomic_uint requested_flow_step {0};
   std::atomic_bool find_clusters_requested {false};
+  std::atomic_bool percolates_requested {false};
+  std::atomic_bool spanning_bidirectional {false};
   std::mutex request_mutex;
 
   std::thread worker_thread;
@@ -0,0 +1,255 @@
+#include <cassert>
+#include <limits>
+
+#include "tiledlattice.h"
+
+
+TiledLattice::TiledLattice(unsigned int width, unsigned int height) {
+  set_size(width, height);
+}
+
+// Leaves every site closed; call assign() after this.
+void TiledLattice::set_size(unsigned int width, unsigned int height) {
+  assert(width > 0 && height > 0);
+  grid_width = width;
+  grid_height = height;
+  tiles_across = (width + tile_size - 1) / tile_size;
+  tiles_down = (height + tile_size - 1) / tile_size;
+  const std::size_t num_tiles {static_cast<std::size_t>(tiles_across) * tiles_down};
+  assert(num_tiles * tile_size * tile_size <= std::numeric_limits<SiteIndex>::max());
+  grid.assign(num_tiles * tile_size * tile_size, Site {});
+  tile_column.resize(num_tiles);
+  tile_row.resize(num_tiles);
+  for (std::size_t tile {0}; tile < num_tiles; ++tile) {
+    tile_column[tile] = tile % tiles_across;
+    tile_row[tile] = tile / tiles_across;
+  }
+  reset_percolation();
+}
+
+unsigned int TiledLattice::get_width() const {
+  return grid_width;
+}
+
+unsigned int TiledLattice::get_height() const {
+  return grid_height;
+}
+
+// Takes the open sites of a lattice of the same size. Nothing is flooded afterwards.
+void TiledLattice::assign(const Lattice &lattice) {
+  assert(lattice.get_width() == grid_width && lattice.get_height() == grid_height);
+  const std::atomic_bool run {true};
+  lattice.for_each_row(
+    [&](int y, const Site* row) {
+      for (int x {0}; x < static_cast<int>(grid_width); ++x) {
+        Site site {};
+        site.open = row[x].open;
+        grid[index_of(x, y)] = site;
+      }
+    }, run);
+  reset_percolation();
+}
+
+Site TiledLattice::get_site(int x, int y) const {
+  return grid[index_of(x, y)];
+}
+
+bool TiledLattice::is_open(int x, int y) const {
+  return get_site(x, y).open;
+}
+
+bool TiledLattice::is_flooded(int x, int y) const {
+  return get_site(x, y).flooded;
+}
+
+Coords TiledLattice::coords_of(SiteIndex site) const {
+  const SiteIndex tile {site / (blocks_per_tile * sites_per_block)};
+  const SiteIndex block {(site / sites_per_block) % blocks_per_tile};
+  const SiteIndex in_block {site % sites_per_block};
+  return Coords(
+    static_cast<int>(tile_column[tile] * tile_size + compact_bits(block) * block_size +
+                     in_block % block_size),
+    static_cast<int>(tile_row[tile] * tile_size + compact_bits(block >> 1) * block_size +
+                     in_block / block_size));
+}
+
+// Within a tile, a site's index is its x and y coordinates with their bits interleaved (see
+// index_of()), so a step along either one is an increment or decrement of only its own bits, with
+// the other's bits held fixed. This needs no branches, except for the moves out of the tile (one
+// in 64). Padding sites may be passed to f, but they're closed.
+template <typename F>
+void TiledLattice::for_each_neighbor(SiteIndex i, F f) const {
+  constexpr SiteIndex sites_per_tile {tile_size * tile_size};
+  const SiteIndex in_tile {i % sites_per_tile};
+  const SiteIndex tile_start {i - in_tile};
+  const SiteIndex x {in_tile & x_bits};
+  const SiteIndex y {in_tile & y_bits};
+  const SiteIndex tile {i / sites_per_tile};
+  // Up
+  if (y != 0) {
+    f(tile_start + (((y - 1) & y_bits) | x));
+  } else if (tile_row[tile] > 0) {
+    f(tile_start - tiles_across * sites_per_tile + (y_bits | x));
+  }
+  // Down
+  if (y != y_bits) {
+    f(tile_start + (((in_tile | x_bits) + 1) & y_bits) + x);
+  } else if (tile_row[tile] + 1 < tiles_down) {
+    f(tile_start + tiles_across * sites_per_tile + x);
+  }
+  // Left
+  if (x != 0) {
+    f(tile_start + (((x - 1) & x_bits) | y));
+  } else if (tile_column[tile] > 0) {
+    f(tile_start - sites_per_tile + (x_bits | y));
+  }
+  // Right
+  if (x != x_bits) {
+    f(tile_start + (((in_tile | y_bits) + 1) & x_bits) + y);
+  } else if (tile_column[tile] + 1 < tiles_across) {
+    f(tile_start + sites_per_tile + y);
+  }
+}
+
+void TiledLattice::reset_percolation() {
+  for (auto &site : grid) {
+    site.flooded = false;
+  }
+  freshly_flooded.clear();
+  next_frontier.clear();
+  flooded_count = 0;
+  cluster_count = 0;
+  size_counts.clear();
+}
+
+// Floods the lattice from the top row, one wave at a time, as Lattice::flow_fully() does. Returns
+// the number of steps (counting the flooding of the top row), or nothing if aborted.
+std::optional<unsigned int> TiledLattice::flow_fully(std::atomic_bool &run) {
+  reset_percolation();
+  freshly_flooded.reset(grid.size(), false);
+  for (int x {0}; x < static_cast<int>(grid_width); ++x) {
+    Site &site {grid[index_of(x, 0)]};
+    if (site.open) {
+      site.flooded = true;
+      freshly_flooded.add(index_of(x, 0));
+    }
+  }
+  freshly_flooded.settle();
+  flooded_count = freshly_flooded.size();
+  unsigned int steps {freshly_flooded.empty() ? 0U : 1U};
+  while (run && flow_one_step(run)) {
+    ++steps;
+  }
+  if (!run) {
+    return std::nullopt;
+  }
+  return steps;
+}
+
+// Takes one step of the flow. Returns true if anything new got flooded.
+bool TiledLattice::flow_one_step(std::atomic_bool &run) {
+  next_frontier.reset(grid.size(),
+                      Frontier::should_be_dense(freshly_flooded.size(), grid.size()));
+  auto visit {
+    [&](SiteIndex i) {
+      Site &site {grid[i]};
+      if (site.open && !site.flooded) {
+        site.flooded = true;
+        next_frontier.add(i);
+      }
+    }};
+  freshly_flooded.for_each([&](SiteIndex i) { for_each_neighbor(i, visit); }, run);
+  next_frontier.settle();
+  std::swap(freshly_flooded, next_frontier);
+  flooded_count += freshly_flooded.size();
+  return !freshly_flooded.empty();
+}
+
+// The number of sites flooded by the last flow_fully(), or labeled by find_clusters().
+std::size_t TiledLattice::num_flooded() const {
+  return flooded_count;
+}
+
+// Labels every cluster by flooding it from its first site, as Lattice::find_clusters() does, but
+// visiting the sites in storage order, tile by tile. Only the cluster sizes are kept. Returns false
+// if aborted.
+bool TiledLattice::find_clusters(std::atomic_bool &run) {
+  reset_percolation();
+  for (SiteIndex i {0}; i < grid.size() && run; ++i) {
+    Site &site {grid[i]};
+    if (!site.open || site.flooded) {
+      continue;
+    }
+    site.flooded = true;
+    freshly_flooded.clear();
+    freshly_flooded.add(i);
+    const std::size_t begin {flooded_count};
+    ++flooded_count;
+    while (flow_one_step(run)) {}
+    const std::size_t size {flooded_count - begin};
+    if (size >= size_counts.size()) {
+      size_counts.resize(size + 1, 0);
+    }
+    ++size_counts[size];
+    ++cluster_count;
+  }
+  freshly_flooded.clear();
+  return run;
+}
+
+unsigned int TiledLattice::num_clusters() const {
+  return cluster_count;
+}
+
+// Element s is the number of clusters of size s, as in Lattice::cluster_size_counts().
+std::span<const unsigned int> TiledLattice::cluster_size_counts() const {
+  return size_counts;
+}
+
+// Fills a Lattice with Bernoulli(p) sites, copies it to a TiledLattice, and times a full flow from
+// the top, and then cluster labeling, on each. Lattice::flow_fully() may spread big frontiers among
+// threads, which the tiled lattice doesn't (yet). Returns nothing if aborted.
+std::optional<LayoutBenchmark> benchmark_layouts(unsigned int width, unsigned int height,
+                                                 double p, uint64_t seed, std::atomic_bool &run) {
+  LayoutBenchmark result {width, height, 0.0, 0.0, 0.0, 0.0, true};
+  Progress progress {run};
+  Lattice lattice {width, height};
+  lattice.set_flow_direction(FlowDirection::top);
+  lattice.fill(measure::bernoulli(p), seed, progress);
+  TiledLattice tiled {width, height};
+  tiled.assign(lattice);
+  if (!run) {
+    return std::nullopt;
+  }
+  auto time_ms {
+    [](auto f) {
+      Stopwatch stopwatch;
+      stopwatch.start();
+      f();
+      return stopwatch.elapsed_ms();
+    }};
+
+  result.row_major_flow_ms = time_ms([&]() { lattice.flow_fully(progress); });
+  std::optional<unsigned int> tiled_steps;
+  result.tiled_flow_ms = time_ms([&]() { tiled_steps = tiled.flow_fully(run); });
+  if (!run || !tiled_steps) {
+    return std::nullopt;
+  }
+  std::size_t row_major_flooded {0};
+  lattice.for_each_site(
+    [&](int x, int y) { row_major_flooded += lattice.is_flooded(x, y); }, run);
+  result.agree = *tiled_steps == lattice.num_flow_steps() &&
+    tiled.num_flooded() == row_major_flooded;
+
+  result.row_major_clusters_ms = time_ms([&]() { lattice.find_clusters(progress); });
+  result.tiled_clusters_ms = time_ms([&]() { tiled.find_clusters(run); });
+  if (!run) {
+    return std::nullopt;
+  }
+  const auto row_major_counts {lattice.cluster_size_counts()};
+  const auto tiled_counts {tiled.cluster_size_counts()};
+  result.agree = result.agree && lattice.num_clusters() == tiled.num_clusters() &&
+    std::equal(row_major_counts.begin(), row_major_counts.end(),
+               tiled_counts.begin(), tiled_counts.end());
+  return result;
+}
@@ -0,0 +1,123 @@
+#ifndef TILEDLATTICE_H
+#define TILEDLATTICE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "utility.h"
+#include "lattice.h"
+
+
+// A lattice stored in tiles, for flows and cluster labeling on lattices far too wide for the
+// cache. In a Lattice, the sites above and below a site are a whole row away, so a flow on a wide
+// lattice misses the cache (and the TLB) at almost every vertical step. Here, the sites are stored
+// in square tiles of tile_size x tile_size sites, each one page of memory, tile after tile along
+// the rows of tiles. Each tile is made of blocks of block_size x block_size sites, each one cache
+// line, in Morton (Z) order; and each block is stored row by row. So nearly every neighbor is on
+// the same cache line, and the rest are usually on the same page.
+//
+// Only the rectangle is supported (not the torus), with flow from the top. Row-major access, for
+// code written for Lattice, is through for_each_row(), which gathers each row in turn.
+class TiledLattice {
+public:
+  static constexpr unsigned int tile_size {64};
+  static constexpr unsigned int block_size {8};
+
+  TiledLattice(unsigned int width, unsigned int height);
+
+  void set_size(unsigned int width, unsigned int height);
+  unsigned int get_width() const;
+  unsigned int get_height() const;
+
+  void assign(const Lattice &lattice);
+  Site get_site(int x, int y) const;
+  bool is_open(int x, int y) const;
+  bool is_flooded(int x, int y) const;
+
+  void reset_percolation();
+  std::optional<unsigned int> flow_fully(std::atomic_bool &run);
+  std::size_t num_flooded() const;
+  bool find_clusters(std::atomic_bool &run);
+  unsigned int num_clusters() const;
+  std::span<const unsigned int> cluster_size_counts() const;
+
+  SiteIndex index_of(int x, int y) const {
+    const SiteIndex tile {static_cast<SiteIndex>(y / tile_size) * tiles_across + x / tile_size};
+    const unsigned int block_x {(x / block_size) % blocks_per_tile_side};
+    const unsigned int block_y {(y / block_size) % blocks_per_tile_side};
+    const SiteIndex block {spread_bits(block_x) | (spread_bits(block_y) << 1)};
+    return (tile * blocks_per_tile + block) * sites_per_block +
+      (y % block_size) * block_size + x % block_size;
+  }
+  Coords coords_of(SiteIndex site) const;
+
+  // f(y, row), where row points to the width sites of row y (a copy, good until the next call).
+  template <typename F> void for_each_row(F f, const std::atomic_bool &run) const;
+
+private:
+  static constexpr unsigned int blocks_per_tile_side {tile_size / block_size};
+  static constexpr unsigned int blocks_per_tile {blocks_per_tile_side * blocks_per_tile_side};
+  static constexpr unsigned int sites_per_block {block_size * block_size};
+
+  // Spreads the bits of a block coordinate apart, to make room for the other's: 0b101 -> 0b10001.
+  static SiteIndex spread_bits(unsigned int v) {
+    return (v & 1) | ((v & 2) << 1) | ((v & 4) << 2);
+  }
+  static unsigned int compact_bits(SiteIndex v) {
+    return (v & 1) | ((v >> 1) & 2) | ((v >> 2) & 4);
+  }
+  // The bits of an index within a tile that hold x, and y: first x and y within the block (three
+  // bits each), then the block's number, in which they alternate.
+  static constexpr SiteIndex x_bits {0b010101'000'111};
+  static constexpr SiteIndex y_bits {0b101010'111'000};
+
+  template <typename F> void for_each_neighbor(SiteIndex i, F f) const;
+  bool flow_one_step(std::atomic_bool &run);
+
+  unsigned int grid_width;
+  unsigned int grid_height;
+  unsigned int tiles_across;
+  unsigned int tiles_down;
+  std::vector<Site> grid;  // Sites beyond the right and bottom edges are padding, always closed.
+  std::vector<unsigned int> tile_column;  // The position of each tile, by tile number
+  std::vector<unsigned int> tile_row;
+  Frontier freshly_flooded;
+  Frontier next_frontier;
+  std::size_t flooded_count {0};
+  unsigned int cluster_count {0};
+  std::vector<unsigned int> size_counts;
+};
+
+template <typename F>
+void TiledLattice::for_each_row(F f, const std::atomic_bool &run) const {
+  std::vector<Site> row(grid_width);
+  for (unsigned int y {0}; y < grid_height && run; ++y) {
+    // A block's row is contiguous.
+    for (unsigned int x {0}; x < grid_width; x += block_size) {
+      const Site* block_row {grid.data() + index_of(x, y)};
+      std::copy(block_row, block_row + std::min(block_size, grid_width - x), row.begin() + x);
+    }
+    f(y, static_cast<const Site*>(row.data()));
+  }
+}
+
+// How the same operations compare on a Lattice and on a TiledLattice.
+struct LayoutBenchmark {
+  unsigned int width;
+  unsigned int height;
+  double row_major_flow_ms;
+  double tiled_flow_ms;
+  double row_major_clusters_ms;
+  double tiled_clusters_ms;
+  bool agree;  // Both layouts flooded the same sites and found the same clusters
+};
+
+std::optional<LayoutBenchmark> benchmark_layouts(unsigned int width, unsigned int height,
+                                                 double p, uint64_t seed, std::atomic_bool &run);
+
+
+#endif  // TILEDLATTICE_H
@@ -1,4 +1,18 @@
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <new>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#endif
 
 #include "utility.h"
 
@@ -7,6 +21,233 @@ void pause_ms(unsigned int ms) {
   std::this_thread::sleep_for(std::chrono::milliseconds(ms));
 }
 
+Progress::Progress(std::atomic_bool &run_flag)
+  : run {run_flag} {}
+
+// The operation is cancelled if it's still running after this many seconds from start(). Zero
+// means no limit.
+void Progress::set_time_budget(double seconds) {
+  time_budget = seconds;
+}
+
+void Progress::start(std::size_t total_work) {
+  start_time = std::chrono::steady_clock::now().time_since_epoch().count();
+  done = 0;
+  total = total_work;
+}
+
+void Progress::advance(std::size_t work) {
+  done.fetch_add(work, std::memory_order_relaxed);
+  const double budget {time_budget.load(std::memory_order_relaxed)};
+  if (budget > 0.0 && elapsed_seconds() > budget) {
+    run = false;
+  }
+}
+
+void Progress::finish() {
+  done = total.load();
+}
+
+ProgressReport Progress::report() const {
+  const std::size_t work_total {total};
+  const std::size_t work_done {std::min(done.load(std::memory_order_relaxed), work_total)};
+  if (work_total == 0) {
+    return {0.0, std::nullopt};
+  }
+  const double fraction {static_cast<double>(work_done) / work_total};
+  if (work_done == 0) {
+    return {fraction, std::nullopt};
+  }
+  // Assume the rest of the work will go as fast as the work done so far.
+  return {fraction, elapsed_seconds() * (1.0 - fraction) / fraction};
+}
+
+double Progress::elapsed_seconds() const {
+  const std::chrono::steady_clock::duration elapsed {
+    std::chrono::steady_clock::now().time_since_epoch().count() - start_time};
+  return std::chrono::duration<double>(elapsed).count();
+}
+
+// The worker that the current thread is, if any.
+static thread_local const ThreadPool* current_pool {nullptr};
+static thread_local std::size_t current_worker {0};
+
+ThreadPool::ThreadPool(unsigned int max_concurrency)
+  : concurrency {std::max(1U, max_concurrency)}
+{
+  const unsigned int num_workers {std::max(1U, concurrency - 1)};
+  for (unsigned int i {0}; i < num_workers; ++i) {
+    queues.push_back(std::make_unique<TaskQueues>());
+  }
+  for (unsigned int i {0}; i < num_workers; ++i) {
+    workers.emplace_back(&ThreadPool::work, this, i);
+  }
+}
+
+// Finishes all queued tasks first.
+ThreadPool::~ThreadPool() {
+  sleep_mutex.lock();
+  stopping = true;
+  sleep_mutex.unlock();
+  wake_up.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+ThreadPool& ThreadPool::shared() {
+  static ThreadPool pool {std::max(1U, std::thread::hardware_concurrency())};
+  return pool;
+}
+
+unsigned int ThreadPool::get_concurrency() const {
+  return concurrency;
+}
+
+unsigned int ThreadPool::get_num_workers() const {
+  return static_cast<unsigned int>(workers.size());
+}
+
+void ThreadPool::submit(std::function<void ()> task, TaskPriority priority) {
+  // A worker keeps its own tasks, which are likely to use data that's already in its cache.
+  const std::size_t index {
+    current_pool == this ? current_worker : next_queue++ % queues.size()};
+  // Counted before it's queued, so that it's never taken before it's counted.
+  ++num_queued;
+  {
+    std::unique_lock<std::mutex> lock {queues[index]->mutex};
+    queues[index]->tasks[static_cast<int>(priority)].push_back(std::move(task));
+  }
+  sleep_mutex.lock();
+  sleep_mutex.unlock();
+  wake_up.notify_one();
+}
+
+// Takes the newest task of the given worker's own, or else steals the oldest task of another
+// worker, by order of priority. Returns false if there are none.
+bool ThreadPool::take_task(std::size_t index, std::function<void ()> &task) {
+  for (std::size_t p {num_priorities}; p-- > 0; ) {
+    for (std::size_t i {0}; i < queues.size(); ++i) {
+      const std::size_t victim {(index + i) % queues.size()};
+      std::unique_lock<std::mutex> lock {queues[victim]->mutex};
+      auto &tasks {queues[victim]->tasks[p]};
+      if (!tasks.empty()) {
+        if (victim == index) {
+          task = std::move(tasks.back());
+          tasks.pop_back();
+        } else {
+          task = std::move(tasks.front());
+          tasks.pop_front();
+        }
+        --num_queued;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void ThreadPool::work(std::size_t index) {
+  current_pool = this;
+  current_worker = index;
+  std::function<void ()> task;
+  while (true) {
+    if (take_task(index, task)) {
+      task();
+      task = nullptr;
+      continue;
+    }
+    std::unique_lock<std::mutex> lock {sleep_mutex};
+    if (stopping && num_queued == 0) {
+      return;
+    }
+    wake_up.wait(lock, [&]() { return stopping || num_queued > 0; });
+  }
+}
+
+// Calls f(begin, end) on consecutive chunks of the range [0, n). The calling thread works through
+// the chunks, helped by as many workers as are free to. The flag run is checked between chunks:
+// once it becomes false, no further chunks are started. Returns true if every chunk was processed,
+// or false if aborted.
+//
+// Called from one of the pool's own tasks, the loop runs on that worker alone: the other workers
+// are busy with tasks of their own (or will be), and helpers queued behind them would only start
+// once the loop is long over.
+bool ThreadPool::parallel_for(std::size_t n, std::size_t chunk_size,
+                              const std::function<void (std::size_t, std::size_t)> &f,
+                              const std::atomic_bool &run,
+                              TaskPriority priority) {
+  assert(chunk_size > 0);
+  if (current_pool == this) {
+    for (std::size_t begin {0}; begin < n; begin += chunk_size) {
+      if (!run) {
+        return false;
+      }
+      f(begin, std::min(begin + chunk_size, n));
+    }
+    return true;
+  }
+  // Helpers that only start once the loop is over must find out that there's nothing left to do,
+  // so they share ownership of its state. The caller's f and run may be gone by then: a helper
+  // only looks at them once it has claimed a chunk, which the caller then waits for.
+  struct Loop {
+    std::size_t n;
+    std::size_t chunk_size;
+    std::size_t num_chunks;
+    const std::function<void (std::size_t, std::size_t)>* f;
+    const std::atomic_bool* run;
+    std::atomic_size_t next_chunk {0};
+    std::atomic_size_t num_done {0};
+    std::atomic_bool aborted {false};
+  };
+  auto loop {std::make_shared<Loop>()};
+  loop->n = n;
+  loop->chunk_size = chunk_size;
+  loop->num_chunks = (n + chunk_size - 1) / chunk_size;
+  loop->f = &f;
+  loop->run = &run;
+  auto process_chunks {
+    [](Loop &state) {
+      while (true) {
+        const std::size_t chunk {state.next_chunk++};
+        if (chunk >= state.num_chunks) {
+          break;
+        }
+        if (*state.run) {
+          const std::size_t begin {chunk * state.chunk_size};
+          (*state.f)(begin, std::min(begin + state.chunk_size, state.n));
+        } else {
+          state.aborted = true;  // Skipping the chunks that are left is cheap.
+        }
+        ++state.num_done;
+        state.num_done.notify_all();
+      }
+    }};
+
+  const std::size_t num_helpers {
+    std::min<std::size_t>(concurrency - 1, loop->num_chunks > 0 ? loop->num_chunks - 1 : 0)};
+  for (std::size_t i {0}; i < num_helpers; ++i) {
+    submit([loop, process_chunks]() { process_chunks(*loop); }, priority);
+  }
+  process_chunks(*loop);
+
+  // No more chunks may be started from here on. Wait for the ones that have been.
+  const std::size_t num_started {std::min(loop->next_chunk.exchange(loop->num_chunks),
+                                          loop->num_chunks)};
+  std::size_t num_done {loop->num_done};
+  while (num_done < num_started) {
+    loop->num_done.wait(num_done);
+    num_done = loop->num_done;
+  }
+  return !loop->aborted && num_started == loop->num_chunks;
+}
+
+bool parallel_for_chunks(std::size_t n, std::size_t chunk_size,
+                         const std::function<void (std::size_t, std::size_t)> &f,
+                         const std::atomic_bool &run) {
+  return ThreadPool::shared().parallel_for(n, chunk_size, f, run);
+}
+
 Stopwatch::Stopwatch() {}
 Stopwatch::~Stopwatch() {}
 
@@ -26,3 +267,138 @@ double Stopwatch::elapsed_ms() {
   auto now {std::chrono::high_resolution_clock::now()};
   return std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time).count();
 }
+
+static constexpr std::size_t huge_page_size {std::size_t{1} << 21};
+
+static std::size_t round_up(std::size_t n, std::size_t multiple) {
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+// Small blocks (less than a huge page) come from the usual heap.
+void* allocate_pages(std::size_t bytes) {
+#if defined(__linux__)
+  if (bytes >= huge_page_size) {
+    // Map an extra huge page, so that the block can start on a huge page boundary, and then
+    // give back the unused ends.
+    const std::size_t length {round_up(bytes, huge_page_size)};
+    const std::size_t mapped_length {length + huge_page_size};
+    void* mapped {mmap(nullptr, mapped_length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)};
+    if (mapped == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    const uintptr_t start {reinterpret_cast<uintptr_t>(mapped)};
+    const uintptr_t aligned {round_up(start, huge_page_size)};
+    if (aligned > start) {
+      munmap(mapped, aligned - start);
+    }
+    if (start + mapped_length > aligned + length) {
+      munmap(reinterpret_cast<void*>(aligned + length), start + mapped_length - aligned - length);
+    }
+    // Only a hint: without transparent huge pages, this fails, and the pages stay small.
+    madvise(reinterpret_cast<void*>(aligned), length, MADV_HUGEPAGE);
+    return reinterpret_cast<void*>(aligned);
+  }
+#elif defined(_WIN32)
+  // Plain pages: large pages (MEM_LARGE_PAGES) need SeLockMemoryPrivilege, which users don't hold
+  // by default.
+  if (bytes >= huge_page_size) {
+    void* memory {VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)};
+    if (!memory) {
+      throw std::bad_alloc();
+    }
+    return memory;
+  }
+#endif
+  return ::operator new(bytes);
+}
+
+// bytes must be the same as was passed to allocate_pages().
+void free_pages(void* memory, std::size_t bytes) {
+  if (!memory) {
+    return;
+  }
+#if defined(__linux__)
+  if (bytes >= huge_page_size) {
+    munmap(memory, round_up(bytes, huge_page_size));
+    return;
+  }
+#elif defined(_WIN32)
+  if (bytes >= huge_page_size) {
+    VirtualFree(memory, 0, MEM_RELEASE);
+    return;
+  }
+#endif
+  ::operator delete(memory);
+}
+
+// Huge pages are counted from /proc/self/smaps. The kernel may merge the block's mapping with its
+// neighbors, so the count is capped at the block's size. NUMA nodes are looked up for a sample of
+// pages, by move_pages() (which, given no target nodes, moves nothing).
+MemoryPlacement memory_placement(const void* memory, std::size_t bytes) {
+  MemoryPlacement placement {bytes, 0, 0, {}};
+#if defined(__linux__)
+  if (!memory || bytes == 0) {
+    return placement;
+  }
+  const uintptr_t begin {reinterpret_cast<uintptr_t>(memory)};
+  const uintptr_t end {begin + bytes};
+  // Too small for a huge page of its own; and reading smaps isn't free.
+  std::ifstream smaps;
+  if (bytes >= huge_page_size) {
+    smaps.open("/proc/self/smaps");
+  }
+  std::string line;
+  bool in_block {false};
+  while (smaps.is_open() && std::getline(smaps, line)) {
+    unsigned long mapping_begin, mapping_end;
+    std::size_t kilobytes;
+    if (std::sscanf(line.c_str(), "%lx-%lx ", &mapping_begin, &mapping_end) == 2) {
+      in_block = mapping_begin < end && begin < mapping_end;
+    } else if (in_block && std::sscanf(line.c_str(), "AnonHugePages: %zu kB", &kilobytes) == 1) {
+      placement.huge_page_bytes += kilobytes * 1024;
+    }
+  }
+  placement.huge_page_bytes = std::min(placement.huge_page_bytes, bytes);
+
+#ifdef SYS_move_pages
+  constexpr std::size_t max_samples {256};
+  const std::size_t page_size {static_cast<std::size_t>(sysconf(_SC_PAGESIZE))};
+  const uintptr_t first_page {begin / page_size * page_size};
+  const std::size_t num_pages {(end - first_page + page_size - 1) / page_size};
+  const std::size_t num_samples {std::min(num_pages, max_samples)};
+  std::vector<void*> pages(num_samples);
+  std::vector<int> nodes(num_samples, -1);
+  for (std::size_t i {0}; i < num_samples; ++i) {
+    pages[i] = reinterpret_cast<void*>(first_page + num_pages * i / num_samples * page_size);
+  }
+  if (syscall(SYS_move_pages, 0, num_samples, pages.data(), nullptr, nodes.data(), 0) == 0) {
+    for (const int node : nodes) {
+      if (node < 0) {
+        continue;  // Not touched yet
+      }
+      if (static_cast<std::size_t>(node) >= placement.pages_per_node.size()) {
+        placement.pages_per_node.resize(node + 1, 0);
+      }
+      ++placement.pages_per_node[node];
+      ++placement.pages_sampled;
+    }
+  }
+#endif
+#endif
+  return placement;
+}
+
+// E.g., "64.0 MiB, 100% in huge pages; node 0: 50%, node 1: 50%".
+std::string MemoryPlacement::describe() const {
+  char buffer[64];
+  std::snprintf(buffer, sizeof(buffer), "%.1f MiB, %.0f%% in huge pages",
+                bytes / 1048576.0, bytes == 0 ? 0.0 : 100.0 * huge_page_bytes / bytes);
+  std::string description {buffer};
+  for (std::size_t node {0}; node < pages_per_node.size(); ++node) {
+    std::snprintf(buffer, sizeof(buffer), "%s node %zu: %.0f%%", node == 0 ? ";" : ",", node,
+                  100.0 * pages_per_node[node] / pages_sampled);
+    description += buffer;
+  }
+  return description;
+}
@@ -2,10 +2,21 @@
 #define UTILITY_H
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <array>
 #include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
 #include <thread>
+#include <vector>
 
 
 class ScopeGuard {
@@ -25,13 +36,6 @@ inline T clamp(T value, T min, T max) {
   return std::max(std::min(value, max), min);
 }
 
-// Comparison for sorting in reverse order
-struct ReverseCmp {
-  bool operator()(const unsigned int& lhs, const unsigned int& rhs) const {
-    return lhs > rhs;
-  }
-};
-
 class Stopwatch {
 public:
   Stopwatch();
@@ -48,4 +52,110 @@ private:
 
 void pause_ms(unsigned int ms);
 
+struct ProgressReport {
+  double fraction_done;
+  std::optional<double> seconds_left;  // Unknown until some progress has been made
+};
+
+// Lets a long operation be cancelled, and report how far along it is. The operation calls start()
+// with the total amount of work, then advance() after each chunk of work, from any thread; others
+// may call report() at any time. Nothing is locked, so this is cheap enough to update once per
+// chunk. Cancelling means making the run flag false, which also happens once the time budget (if
+// any) runs out.
+class Progress {
+public:
+  explicit Progress(std::atomic_bool &run_flag);
+
+  std::atomic_bool& run_flag() { return run; }
+  bool running() const { return run; }
+  void set_time_budget(double seconds);
+
+  void start(std::size_t total_work);
+  void advance(std::size_t work);
+  void finish();
+  ProgressReport report() const;
+
+private:
+  double elapsed_seconds() const;
+
+  std::atomic_bool &run;
+  std::atomic_size_t total {0};
+  std::atomic_size_t done {0};
+  std::atomic<std::chrono::steady_clock::rep> start_time {0};
+  std::atomic<double> time_budget {0.0};  // Seconds, or 0 for no limit
+};
+
+enum class TaskPriority : int {low, normal, high};
+
+// A work-stealing pool of threads. Each worker has its own queue of tasks for each priority, and
+// takes its newest task first; an idle worker steals the oldest task of another one. Higher
+// priority tasks are always taken first. Use shared() to share the cores among all the parallel
+// kernels, rather than have each of them start its own threads. Tasks should be short: a long job
+// is better split into tasks that each submit the next, so that the workers stay free for others.
+class ThreadPool {
+public:
+  // The pool runs concurrency - 1 worker threads (but at least one): the thread that calls
+  // parallel_for() does its share of the work, too.
+  explicit ThreadPool(unsigned int max_concurrency);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) =delete;
+  ThreadPool& operator=(const ThreadPool&) =delete;
+
+  static ThreadPool& shared();
+
+  void submit(std::function<void ()> task, TaskPriority priority = TaskPriority::normal);
+  bool parallel_for(std::size_t n, std::size_t chunk_size,
+                    const std::function<void (std::size_t, std::size_t)> &f,
+                    const std::atomic_bool &run,
+                    TaskPriority priority = TaskPriority::normal);
+  unsigned int get_concurrency() const;
+  unsigned int get_num_workers() const;
+
+private:
+  static constexpr std::size_t num_priorities {3};
+  struct TaskQueues {
+    std::mutex mutex;
+    std::array<std::deque<std::function<void ()>>, num_priorities> tasks;
+  };
+
+  void work(std::size_t index);
+  bool take_task(std::size_t index, std::function<void ()> &task);
+
+  unsigned int concurrency;
+  std::vector<std::unique_ptr<TaskQueues>> queues;  // One for each worker
+  std::vector<std::thread> workers;
+  std::atomic_size_t next_queue {0};  // For tasks submitted from outside the pool
+  std::atomic_size_t num_queued {0};
+  std::mutex sleep_mutex;
+  std::condition_variable wake_up;
+  bool stopping {false};
+};
+
+// Calls f(begin, end) on consecutive chunks of the range [0, n), on the shared thread pool. The
+// flag run is checked between chunks: once it becomes false, no further chunks are started.
+// Returns true if every chunk was processed, or false if aborted.
+bool parallel_for_chunks(std::size_t n, std::size_t chunk_size,
+                         const std::function<void (std::size_t, std::size_t)> &f,
+                         const std::atomic_bool &run);
+
+// Memory for big arrays, straight from the operating system, in whole pages. Where the system
+// allows it, the pages are transparent huge pages (2 MiB), which saves TLB misses. They're left
+// untouched, so that each page lands on the NUMA node of the thread that first writes to it: have
+// the threads that will work on each part of the array zero it themselves.
+void* allocate_pages(std::size_t bytes);
+void free_pages(void* memory, std::size_t bytes);
+
+// Where the pages of a block of memory ended up. Placement is found out by sampling pages, and
+// only on Linux; elsewhere, the node counts are empty.
+struct MemoryPlacement {
+  std::size_t bytes;
+  std::size_t huge_page_bytes;  // Backed by huge pages
+  std::size_t pages_sampled;
+  std::vector<std::size_t> pages_per_node;  // Of the pages sampled, how many are on each node
+  std::string describe() const;
+};
+
+MemoryPlacement memory_placement(const void* memory, std::size_t bytes);
+
 #endif  // UTILITY_H